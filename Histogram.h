@@ -0,0 +1,74 @@
+#include <stdint.h>
+#include <string.h>
+#ifndef _HISTOGRAM_H
+#define _HISTOGRAM_H
+
+/*
+ * Log linear (HDR style) buckets: values below 16 have their own bucket, above that every power of two is split
+ * in 16 linear sub buckets, so a bucket is at most 1/16 (6.25%) of its value wide and the whole uint64_t range
+ * fits in 976 buckets. Mapping a value is a count leading zeros and two shifts.
+ */
+struct LogLinearBuckets
+{
+   static const uint32_t SUB_BUCKET_BITS = 4;
+   static const uint32_t SUB_BUCKETS = 1u << SUB_BUCKET_BITS;
+   static const uint32_t COUNT = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+   static uint32_t index(uint64_t value)
+   {
+      if (value < SUB_BUCKETS) return static_cast<uint32_t>(value);
+      uint32_t exponent = 63 - __builtin_clzll(value);
+      uint32_t shift = exponent - SUB_BUCKET_BITS;
+      return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + static_cast<uint32_t>((value >> shift) & (SUB_BUCKETS - 1));
+   }
+   /* smallest value mapped to bucket idx */
+   static uint64_t lowerBound(uint32_t idx)
+   {
+      if (idx < SUB_BUCKETS) return idx;
+      uint32_t exponent = idx / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+      uint64_t sub = idx % SUB_BUCKETS;
+      return (SUB_BUCKETS + sub) << (exponent - SUB_BUCKET_BITS);
+   }
+   /* largest value mapped to bucket idx */
+   static uint64_t upperBound(uint32_t idx)
+   {
+      return idx + 1 < COUNT ? lowerBound(idx + 1) - 1 : ~0ULL;
+   }
+};
+
+/* bucket counts of a histogram, collector side (merging, percentiles) */
+class HistogramData
+{
+  public:
+     HistogramData() { clear(); }
+     void clear()
+     {
+        memset(_buckets, 0, sizeof(_buckets));
+        _count = 0;
+     }
+     void add(uint32_t bucket, uint64_t count)
+     {
+        _buckets[bucket] += count;
+        _count += count;
+     }
+     uint64_t count() const { return _count; }
+     /* value at quantile q (0.5 = p50, 0.999 = p999), reported as the upper bound of its bucket */
+     uint64_t percentile(double q) const
+     {
+        if (0 == _count) return 0;
+        uint64_t rank = static_cast<uint64_t>(q * _count);
+        if (rank >= _count) rank = _count - 1;
+        uint64_t seen = 0;
+        for (uint32_t i = 0; i < LogLinearBuckets::COUNT; ++i)
+        {
+           seen += _buckets[i];
+           if (seen > rank) return LogLinearBuckets::upperBound(i);
+        }
+        return LogLinearBuckets::upperBound(LogLinearBuckets::COUNT - 1);
+     }
+  private:
+     uint64_t _buckets[LogLinearBuckets::COUNT];
+     uint64_t _count;
+};
+
+#endif /* _HISTOGRAM_H */
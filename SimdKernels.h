@@ -0,0 +1,166 @@
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#ifndef _SIMD_KERNELS_H
+#define _SIMD_KERNELS_H
+
+/*
+ * SimdKernels - add and delta of dense uint64_t counter arrays (static stats blocks, histogram buckets).
+ *    SimdKernels::add(total, other, n);                        //total[i] += other[i]
+ *    SimdKernels::delta(out, current, lastSeen, n);            //out[i] = current[i] - lastSeen[i], lastSeen = current
+ *    SimdKernels::load(current, counters, n);                  //current[i] = counters[i].load(relaxed)
+ * AVX-512 or AVX2 when the cpu has them, scalar otherwise, picked once at the first call (__builtin_cpu_supports).
+ * The AVX code is compiled with target attributes, no -mavx2 / -mavx512f needed and the binary runs on any x86.
+ * The kernels only take plain arrays. A counter array its owner keeps writing (std::atomic<uint64_t>) is copied
+ * with load() first and the kernel runs on the copy, a vector load of the atomics themselves would race with the
+ * owner stores.
+ */
+struct SimdKernels
+{
+  enum Isa { SCALAR, AVX2, AVX512 };
+  typedef void (*AddFn)(uint64_t* dst, const uint64_t* src, size_t n);
+  typedef bool (*DeltaFn)(uint64_t* delta, const uint64_t* current, uint64_t* lastSeen, size_t n);
+
+  static void add(uint64_t* dst, const uint64_t* src, size_t n)
+  {
+     static const AddFn fn = addFor(best());
+     fn(dst, src, n);
+  }
+  /* false if nothing changed (every delta is 0) */
+  static bool delta(uint64_t* delta, const uint64_t* current, uint64_t* lastSeen, size_t n)
+  {
+     static const DeltaFn fn = deltaFor(best());
+     return fn(delta, current, lastSeen, n);
+  }
+
+  /* relaxed copy of a counter array written by another thread, the input of delta() */
+  static void load(uint64_t* dst, const std::atomic<uint64_t>* src, size_t n)
+  {
+     for (size_t i = 0; i < n; ++i) dst[i] = src[i].load(std::memory_order_relaxed);
+  }
+
+  static Isa best()
+  {
+#if defined(__x86_64__) || defined(__i386__)
+     __builtin_cpu_init();
+     if (__builtin_cpu_supports("avx512f")) return AVX512;
+     if (__builtin_cpu_supports("avx2")) return AVX2;
+#endif
+     return SCALAR;
+  }
+  static const char* name(Isa isa) { return AVX512 == isa ? "avx512" : AVX2 == isa ? "avx2" : "scalar"; }
+  /* a given implementation, the cpu must support it (benchmarks, tests) */
+  static AddFn addFor(Isa isa)
+  {
+#if defined(__x86_64__) || defined(__i386__)
+     if (AVX512 == isa) return addAvx512;
+     if (AVX2 == isa) return addAvx2;
+#endif
+     return addScalar;
+  }
+  static DeltaFn deltaFor(Isa isa)
+  {
+#if defined(__x86_64__) || defined(__i386__)
+     if (AVX512 == isa) return deltaAvx512;
+     if (AVX2 == isa) return deltaAvx2;
+#endif
+     return deltaScalar;
+  }
+
+  static void addScalar(uint64_t* dst, const uint64_t* src, size_t n)
+  {
+     for (size_t i = 0; i < n; ++i) dst[i] += src[i];
+  }
+  static bool deltaScalar(uint64_t* delta, const uint64_t* current, uint64_t* lastSeen, size_t n)
+  {
+     uint64_t changed = 0;
+     for (size_t i = 0; i < n; ++i)
+     {
+        uint64_t value = current[i];
+        delta[i] = value - lastSeen[i];
+        changed |= delta[i];
+        lastSeen[i] = value;
+     }
+     return 0 != changed;
+  }
+
+#if defined(__x86_64__) || defined(__i386__)
+  __attribute__((target("avx2"))) static void addAvx2(uint64_t* dst, const uint64_t* src, size_t n)
+  {
+     size_t i = 0;
+     for (; i + 4 <= n; i += 4)
+     {
+        __m256i sum = _mm256_add_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i)),
+                                       _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), sum);
+     }
+     for (; i < n; ++i) dst[i] += src[i];
+  }
+  __attribute__((target("avx2"))) static bool deltaAvx2(uint64_t* delta, const uint64_t* current, uint64_t* lastSeen, size_t n)
+  {
+     __m256i changed = _mm256_setzero_si256();
+     size_t i = 0;
+     for (; i + 4 <= n; i += 4)
+     {
+        __m256i value = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(current + i));
+        __m256i diff = _mm256_sub_epi64(value, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lastSeen + i)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(delta + i), diff);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(lastSeen + i), value);
+        changed = _mm256_or_si256(changed, diff);
+     }
+     bool any = !_mm256_testz_si256(changed, changed);
+     for (; i < n; ++i)
+     {
+        uint64_t value = current[i];
+        delta[i] = value - lastSeen[i];
+        any = any || delta[i];
+        lastSeen[i] = value;
+     }
+     return any;
+  }
+  /* the tail is one masked load / store instead of a scalar loop */
+  __attribute__((target("avx512f"))) static void addAvx512(uint64_t* dst, const uint64_t* src, size_t n)
+  {
+     size_t i = 0;
+     for (; i + 8 <= n; i += 8)
+     {
+        __m512i sum = _mm512_add_epi64(_mm512_loadu_si512(dst + i), _mm512_loadu_si512(src + i));
+        _mm512_storeu_si512(dst + i, sum);
+     }
+     if (i < n)
+     {
+        __mmask8 mask = static_cast<__mmask8>((1u << (n - i)) - 1);
+        __m512i sum = _mm512_add_epi64(_mm512_maskz_loadu_epi64(mask, dst + i), _mm512_maskz_loadu_epi64(mask, src + i));
+        _mm512_mask_storeu_epi64(dst + i, mask, sum);
+     }
+  }
+  __attribute__((target("avx512f"))) static bool deltaAvx512(uint64_t* delta, const uint64_t* current, uint64_t* lastSeen, size_t n)
+  {
+     __m512i changed = _mm512_setzero_si512();
+     size_t i = 0;
+     for (; i + 8 <= n; i += 8)
+     {
+        __m512i value = _mm512_loadu_si512(current + i);
+        __m512i diff = _mm512_sub_epi64(value, _mm512_loadu_si512(lastSeen + i));
+        _mm512_storeu_si512(delta + i, diff);
+        _mm512_storeu_si512(lastSeen + i, value);
+        changed = _mm512_or_si512(changed, diff);
+     }
+     if (i < n)
+     {
+        __mmask8 mask = static_cast<__mmask8>((1u << (n - i)) - 1);
+        __m512i value = _mm512_maskz_loadu_epi64(mask, current + i);
+        __m512i diff = _mm512_sub_epi64(value, _mm512_maskz_loadu_epi64(mask, lastSeen + i));
+        _mm512_mask_storeu_epi64(delta + i, mask, diff);
+        _mm512_mask_storeu_epi64(lastSeen + i, mask, value);
+        changed = _mm512_or_si512(changed, diff);
+     }
+     return 0 != _mm512_test_epi64_mask(changed, changed);
+  }
+#endif
+};
+
+#endif /* _SIMD_KERNELS_H */
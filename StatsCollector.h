@@ -0,0 +1,241 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <system_error>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include "Histogram.h"
+#ifndef _STATS_COLLECTOR_H
+#define _STATS_COLLECTOR_H
+
+/* stat id the collectors record their own pass duration (ns) under */
+static const uint32_t COLLECTOR_PASS_STAT_ID = 0xFFFF0000;
+/*
+ * Self instrumentation: what the stats library itself costs, recorded by the collector after every pass through the
+ * regular update path (ThreadStatsMapContainer::enableSelfStats() / SelfStats in stats.cpp), so these stats reach
+ * the aggregated stats and the exporters with the next pass.
+ */
+static const uint32_t SELF_COLLECT_NS_STAT_ID = 0xFFFF0001;   //< aggregate() / fetch() duration
+static const uint32_t SELF_LOCK_WAIT_NS_STAT_ID = 0xFFFF0002; //< time waited on contended locks, writers and collector
+static const uint32_t SELF_LOCK_HOLD_NS_STAT_ID = 0xFFFF0003; //< time the collection held its locks
+static const uint32_t SELF_MAPS_STAT_ID = 0xFFFF0004;         //< live thread maps (TLS), registered counters (atomic)
+static const uint32_t SELF_BYTES_STAT_ID = 0xFFFF0005;        //< bytes per thread map (TLS), StatsMap bytes (atomic)
+static const uint32_t SELF_ALLOCATIONS_STAT_ID = 0xFFFF0006;  //< allocations of the library in the interval
+static const uint32_t SELF_NEW_KEYS_STAT_ID = 0xFFFF0007;     //< keys (TLS) / counters (atomic) created
+static const uint32_t SELF_LAST_STAT_ID = SELF_NEW_KEYS_STAT_ID;
+
+inline bool isSelfStat(uint64_t statId) { return statId >= COLLECTOR_PASS_STAT_ID && statId <= SELF_LAST_STAT_ID; }
+
+/* locks mtx, returns the time (ns) it waited: try first, the clock is only read when the lock is contended */
+inline uint64_t lockTimed(std::mutex& mtx)
+{
+   if (mtx.try_lock()) return 0;
+   std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+   mtx.lock();
+   return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+}
+
+/*
+ * StatsCollector - runs the collection pass (fetch + merge, aggregate()) on its own thread.
+ *
+ *    StatsCollector collector([&]() { FETCH_STATS_OBJ(snapshot); aggregator.merge(snapshot); });
+ *    collector.subscribe(std::chrono::seconds(1), [&](bool final) { ...print... });
+ *    collector.subscribe(std::chrono::seconds(60), [&](bool final) { ...export the minute... });
+ *    collector.start();
+ *    ...
+ *    collector.stop();    //one last pass, every subscriber is called with final = true
+ *
+ * Every subscriber has an absolute deadline (start + k * interval), the thread sleeps until the earliest one, runs
+ * one pass and calls every subscriber that is due, so a 1s, a 10s and a 60s subscriber share the pass of every
+ * 10th / 60th second. A late pass does not shift the following deadlines (no drift), missed deadlines are skipped.
+ * flush() runs an extra pass right away (e.g. before a shutdown or a scrape) and waits for it.
+ * Subscribers, the pass and the pass done hook run on the collector thread.
+ * Every pass duration also goes to a histogram (passHistogram(), p50 / p99 of the pass to size the intervals).
+ */
+class StatsCollector
+{
+  public:
+     typedef std::function<void()> Pass;
+     typedef std::function<void(bool final)> Subscriber;
+     typedef std::function<void(uint64_t passNs)> PassDone;
+     typedef std::chrono::steady_clock Clock;
+
+     explicit StatsCollector(Pass pass)
+      : _pass(pass), _cpu(-1), _running(false), _stopping(false), _flushRequests(0), _flushesDone(0)
+        , _passes(0), _lastPassNs(0), _maxPassNs(0)
+     {
+     }
+     ~StatsCollector() { stop(); }
+     StatsCollector(const StatsCollector&) = delete;
+     StatsCollector& operator=(const StatsCollector&) = delete;
+
+     /* before start() */
+     void subscribe(std::chrono::nanoseconds interval, Subscriber subscriber)
+     {
+        Subscription subscription = { interval, Clock::time_point(), subscriber };
+        _subscribers.push_back(subscription);
+     }
+     /* pins the collector thread to cpu (keeps it away from the workers cpus), before start() */
+     void setAffinity(int cpu) { _cpu = cpu; }
+     /* called after every pass with its duration, e.g. to record it as a stat, before start() */
+     void onPassDone(PassDone passDone) { _passDone = passDone; }
+
+     void start()
+     {
+        std::lock_guard<std::mutex> lck (_mtx);
+        if (_running) return;
+        _running = true;
+        _stopping = false;
+        _thread = std::thread(&StatsCollector::run, this);
+     }
+     /* final pass, final subscriber calls, joins the collector thread */
+     void stop()
+     {
+        {
+           std::lock_guard<std::mutex> lck (_mtx);
+           if (!_running) return;
+           _stopping = true;
+        }
+        _cv.notify_all();
+        _thread.join();
+        std::lock_guard<std::mutex> lck (_mtx);
+        _running = false;
+     }
+     /* runs a pass now and waits for it, subscribers are not called */
+     void flush()
+     {
+        std::unique_lock<std::mutex> lck (_mtx);
+        if (!_running) return;
+        uint64_t request = ++_flushRequests;
+        _cv.notify_all();
+        _cv.wait(lck, [&]() { return _flushesDone >= request || !_running || _stopping; });
+     }
+
+     uint64_t passes() const { return _passes.load(std::memory_order_relaxed); }
+     uint64_t lastPassNs() const { return _lastPassNs.load(std::memory_order_relaxed); }
+     uint64_t maxPassNs() const { return _maxPassNs.load(std::memory_order_relaxed); }
+     /* durations (ns) of every pass since start(), read it from the subscribers (collector thread) */
+     const HistogramData& passHistogram() const { return _passHistogram; }
+
+  private:
+     struct Subscription
+     {
+        std::chrono::nanoseconds interval;
+        Clock::time_point deadline;
+        Subscriber subscriber;
+     };
+
+     void run()
+     {
+        if (_cpu >= 0) pin(_cpu);
+        Clock::time_point start = Clock::now();
+        for (auto& subscription : _subscribers) subscription.deadline = start + subscription.interval;
+
+        std::unique_lock<std::mutex> lck (_mtx);
+        while (true)
+        {
+           auto wake = [&]() { return _stopping || _flushesDone < _flushRequests; };
+           if (_subscribers.empty())
+           {
+              _cv.wait(lck, wake); //flush() and stop() only
+           }
+           else
+           {
+              Clock::time_point next = _subscribers[0].deadline;
+              for (auto& subscription : _subscribers) next = std::min(next, subscription.deadline);
+              _cv.wait_until(lck, next, wake);
+           }
+           if (_stopping) break;
+           uint64_t flushes = _flushRequests;
+           lck.unlock();
+
+           runPass();
+           Clock::time_point now = Clock::now();
+           for (auto& subscription : _subscribers)
+           {
+              if (subscription.deadline > now) continue;
+              subscription.subscriber(false);
+              while (subscription.deadline <= now) subscription.deadline += subscription.interval;
+           }
+
+           lck.lock();
+           if (_flushesDone < flushes)
+           {
+              _flushesDone = flushes;
+              _cv.notify_all();
+           }
+        }
+        lck.unlock();
+        runPass();
+        for (auto& subscription : _subscribers) subscription.subscriber(true);
+        lck.lock();
+        _flushesDone = _flushRequests;
+        _cv.notify_all();
+     }
+     void runPass()
+     {
+        Clock::time_point begin = Clock::now();
+        _pass();
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - begin).count();
+        _passes.fetch_add(1, std::memory_order_relaxed);
+        _lastPassNs.store(ns, std::memory_order_relaxed);
+        if (ns > _maxPassNs.load(std::memory_order_relaxed)) _maxPassNs.store(ns, std::memory_order_relaxed);
+        _passHistogram.add(LogLinearBuckets::index(ns), 1);
+        if (_passDone) _passDone(ns);
+     }
+     static void pin(int cpu)
+     {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus); //best effort, runs unpinned on error
+     }
+
+     Pass _pass;
+     PassDone _passDone;
+     std::vector<Subscription> _subscribers;
+     int _cpu;
+     std::thread _thread;
+     std::mutex _mtx;
+     std::condition_variable _cv;
+     bool _running;
+     bool _stopping;
+     uint64_t _flushRequests;
+     uint64_t _flushesDone;
+     std::atomic<uint64_t> _passes;
+     std::atomic<uint64_t> _lastPassNs;
+     std::atomic<uint64_t> _maxPassNs;
+     HistogramData _passHistogram;
+};
+
+/* one shot event, a thread blocks on wait() instead of spinning on a flag */
+class StatsEvent
+{
+  public:
+     StatsEvent() : _set(false) {}
+     void set()
+     {
+        {
+           std::lock_guard<std::mutex> lck (_mtx);
+           _set = true;
+        }
+        _cv.notify_all();
+     }
+     void wait()
+     {
+        std::unique_lock<std::mutex> lck (_mtx);
+        _cv.wait(lck, [this]() { return _set; });
+     }
+  private:
+     std::mutex _mtx;
+     std::condition_variable _cv;
+     bool _set;
+};
+
+#endif /* _STATS_COLLECTOR_H */
@@ -0,0 +1,287 @@
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <system_error>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#ifndef _STATS_EXPORTER_H
+#define _STATS_EXPORTER_H
+
+/* one exported value, the collectors (stats.cpp, TLS/stats.cpp) turn their aggregated stats into these */
+struct ExportRecord
+{
+  uint64_t statId;
+  uint32_t collectionId; //< 0 when the stat has no collections
+  uint8_t  kind;         //< StatType / StatKind of the collector, opaque here
+  uint64_t value;
+};
+
+/*
+ * StatsExporter - called by the collector after each aggregation, from the collector thread only.
+ * records is only valid during the call, the collector reuses the array for the next interval.
+ */
+class StatsExporter
+{
+  public:
+     virtual ~StatsExporter() {}
+     /* timestampNs: end of the interval (steady clock), intervalNs: its length */
+     virtual void exportStats(uint64_t timestampNs, uint64_t intervalNs, const ExportRecord* records, size_t count) = 0;
+};
+
+/* little endian base 128 varint, zigzag maps signed deltas to small unsigned values */
+struct Varint
+{
+  static const uint32_t MAX_BYTES = 10;
+
+  static uint8_t* put(uint8_t* out, uint64_t value)
+  {
+     if (__builtin_expect(value < 0x80, 1))
+     {
+        *out = static_cast<uint8_t>(value);
+        return out + 1;
+     }
+     while (value >= 0x80)
+     {
+        *out++ = static_cast<uint8_t>(value) | 0x80;
+        value >>= 7;
+     }
+     *out++ = static_cast<uint8_t>(value);
+     return out;
+  }
+  /* nullptr on a truncated or overlong varint */
+  static const uint8_t* get(const uint8_t* in, const uint8_t* end, uint64_t& value)
+  {
+     value = 0;
+     for (uint32_t shift = 0; shift < 64 && in < end; shift += 7)
+     {
+        uint8_t byte = *in++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (0 == (byte & 0x80)) return in;
+     }
+     return nullptr;
+  }
+  static uint64_t zigzag(int64_t value) { return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63); }
+  static int64_t unzigzag(uint64_t value) { return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1); }
+};
+
+/*
+ * Binary snapshot format, one frame per interval:
+ *
+ *   header : magic "LSC1" (4 bytes), flags (1 byte, bit 0 keyframe), timestamp ns (8 bytes LE),
+ *            interval ns (8 bytes LE), record count (varint)
+ *   record : same key (statId, collectionId, kind) as record i of the previous frame
+ *                      -> varint( zigzag(value - previous value) << 1 | 1 )
+ *            otherwise -> varint( zigzag(statId - previous record statId) << 1 ), varint collectionId, kind byte,
+ *                         varint value
+ *
+ * The collectors emit their stats in a stable order, so in steady state every record is a "same key" record and
+ * a stat that did not move costs one byte. A keyframe references nothing of the previous frame, the encoder
+ * writes one every keyframeInterval frames so a reader can start in the middle of a stream.
+ * Encoder and decoder keep the previous frame keys and values by position, so they must see the same frames.
+ */
+class SnapshotEncoder
+{
+  public:
+     static const uint32_t MAGIC = 0x3143534c; //"LSC1"
+     static const uint32_t HEADER_SIZE = 4 + 1 + 8 + 8 + Varint::MAX_BYTES;
+     static const uint32_t MAX_RECORD_SIZE = 3 * Varint::MAX_BYTES + 1;
+     static const uint8_t  KEYFRAME = 1;
+
+     explicit SnapshotEncoder(size_t expectedRecords = 1024, uint32_t keyframeInterval = 60)
+      : _prevCount(0), _size(0), _frames(0), _keyframeInterval(keyframeInterval ? keyframeInterval : 1)
+     {
+        reserve(expectedRecords);
+     }
+     /* encodes one frame into the internal buffer, valid until the next encode(), allocates only when growing */
+     const uint8_t* encode(uint64_t timestampNs, uint64_t intervalNs, const ExportRecord* records, size_t count)
+     {
+        reserve(count);
+        bool keyframe = 0 == _frames++ % _keyframeInterval;
+        uint8_t* out = &_buffer[0];
+        uint32_t magic = MAGIC;
+        memcpy(out, &magic, 4); out += 4;
+        *out++ = keyframe ? KEYFRAME : 0;
+        memcpy(out, &timestampNs, 8); out += 8;
+        memcpy(out, &intervalNs, 8); out += 8;
+        out = Varint::put(out, count);
+
+        size_t previous = keyframe ? 0 : std::min(_prevCount, count);
+        _prevCount = count;
+        ExportRecord* prev = &_prev[0];
+        uint64_t lastId = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+           const ExportRecord& record = records[i];
+           if (i < previous && prev[i].statId == record.statId && prev[i].collectionId == record.collectionId &&
+               prev[i].kind == record.kind)
+           {
+              out = Varint::put(out, Varint::zigzag(record.value - prev[i].value) << 1 | 1);
+              prev[i].value = record.value;
+           }
+           else
+           {
+              out = Varint::put(out, Varint::zigzag(record.statId - lastId) << 1);
+              out = Varint::put(out, record.collectionId);
+              *out++ = record.kind;
+              out = Varint::put(out, record.value);
+              prev[i] = record;
+           }
+           lastId = record.statId;
+        }
+        _size = out - &_buffer[0];
+        return &_buffer[0];
+     }
+     size_t size() const { return _size; }
+     const uint8_t* data() const { return &_buffer[0]; }
+     /* next frame is a keyframe (e.g. a sink reopened its file) */
+     void reset() { _frames = 0; }
+
+  private:
+     void reserve(size_t count)
+     {
+        size_t needed = HEADER_SIZE + count * MAX_RECORD_SIZE;
+        if (_buffer.size() < needed) _buffer.resize(needed);
+        if (_prev.size() < count + 1) _prev.resize(count + 1);
+     }
+     std::vector<uint8_t> _buffer;
+     std::vector<ExportRecord> _prev; //< previous frame, by position, updated in place while encoding
+     size_t _prevCount;
+     size_t _size;
+     uint64_t _frames;
+     uint32_t _keyframeInterval;
+};
+
+/* reader side of SnapshotEncoder, frames must be decoded in the order they were encoded */
+class SnapshotDecoder
+{
+  public:
+     SnapshotDecoder() : _timestampNs(0), _intervalNs(0), _synced(false) {}
+     /* false on a corrupt frame or a delta frame before the first keyframe, the records are then not usable */
+     bool decode(const uint8_t* data, size_t size)
+     {
+        const uint8_t* end = data + size;
+        uint32_t magic = 0;
+        if (size < 4 + 1 + 8 + 8) return false;
+        memcpy(&magic, data, 4);
+        if (SnapshotEncoder::MAGIC != magic) return false;
+        bool keyframe = data[4] & SnapshotEncoder::KEYFRAME;
+        if (!keyframe && !_synced) return false;
+        memcpy(&_timestampNs, data + 5, 8);
+        memcpy(&_intervalNs, data + 13, 8);
+        const uint8_t* in = data + 21;
+        uint64_t count = 0;
+        if (nullptr == (in = Varint::get(in, end, count)) || count > static_cast<uint64_t>(end - in)) return fail();
+
+        size_t previous = keyframe ? 0 : _records.size();
+        _next.resize(count);
+        uint64_t lastId = 0;
+        for (uint64_t i = 0; i < count; ++i)
+        {
+           ExportRecord& record = _next[i];
+           uint64_t tag = 0;
+           if (nullptr == (in = Varint::get(in, end, tag))) return fail();
+           if (tag & 1)
+           {
+              if (i >= previous) return fail();
+              record = _records[i];
+              record.value += Varint::unzigzag(tag >> 1);
+           }
+           else
+           {
+              uint64_t collectionId = 0;
+              record.statId = lastId + Varint::unzigzag(tag >> 1);
+              if (nullptr == (in = Varint::get(in, end, collectionId)) || in >= end) return fail();
+              record.collectionId = static_cast<uint32_t>(collectionId);
+              record.kind = *in++;
+              if (nullptr == (in = Varint::get(in, end, record.value))) return fail();
+           }
+           lastId = record.statId;
+        }
+        _records.swap(_next);
+        _synced = true;
+        return true;
+     }
+     const std::vector<ExportRecord>& records() const { return _records; }
+     uint64_t timestampNs() const { return _timestampNs; }
+     uint64_t intervalNs() const { return _intervalNs; }
+  private:
+     bool fail()
+     {
+        _synced = false; //wait for the next keyframe
+        return false;
+     }
+     std::vector<ExportRecord> _records;
+     std::vector<ExportRecord> _next;
+     uint64_t _timestampNs;
+     uint64_t _intervalNs;
+     bool _synced;
+};
+
+/*
+ * FileExporter - writes every interval as a length prefixed (4 bytes LE) binary frame to a file or a named pipe.
+ *    FileExporter exporter("/var/run/stats.bin");
+ * A pipe without reader (EPIPE, SIGPIPE must be ignored by the process) or a full disk drops the frame, the next
+ * frame is then a keyframe. Prefix and body go out in one writev(), a file is cut back to the end of the last
+ * complete frame when a write fails half way, so a reader never sees a torn frame followed by a valid one.
+ */
+class FileExporter : public StatsExporter
+{
+  public:
+     explicit FileExporter(const std::string& path, bool append = false, size_t expectedRecords = 1024)
+      : _encoder(expectedRecords)
+     {
+        _fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0644);
+        if (_fd < 0) throw std::system_error(errno, std::generic_category(), path);
+        _frameEnd = ::lseek(_fd, 0, SEEK_END); //-1 on a pipe, nothing to cut back there
+     }
+     virtual ~FileExporter() { ::close(_fd); }
+     FileExporter(const FileExporter&) = delete;
+     FileExporter& operator=(const FileExporter&) = delete;
+
+     virtual void exportStats(uint64_t timestampNs, uint64_t intervalNs, const ExportRecord* records, size_t count)
+     {
+        _encoder.encode(timestampNs, intervalNs, records, count);
+        uint32_t length = static_cast<uint32_t>(_encoder.size());
+        struct iovec frame[2] = { { &length, sizeof(length) }, { const_cast<uint8_t*>(_encoder.data()), length } };
+        if (write(frame, 2))
+        {
+           if (_frameEnd >= 0) _frameEnd += sizeof(length) + length;
+           return;
+        }
+        if (_frameEnd >= 0)
+        {
+           if (::ftruncate(_fd, _frameEnd) < 0 || ::lseek(_fd, _frameEnd, SEEK_SET) < 0) _frameEnd = ::lseek(_fd, 0, SEEK_END);
+        }
+        _encoder.reset();
+     }
+  private:
+     /* writes the whole frame, resumes after a short write or EINTR, false on an error */
+     bool write(struct iovec* iov, int count)
+     {
+        while (count)
+        {
+           ssize_t written = ::writev(_fd, iov, count);
+           if (written < 0)
+           {
+              if (EINTR == errno) continue;
+              return false;
+           }
+           for (; count && static_cast<size_t>(written) >= iov->iov_len; ++iov, --count) written -= iov->iov_len;
+           if (count)
+           {
+              iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + written;
+              iov->iov_len -= written;
+           }
+        }
+        return true;
+     }
+     SnapshotEncoder _encoder;
+     int _fd;
+     off_t _frameEnd; //< end of the last complete frame, -1 when the fd is not seekable
+};
+
+#endif /* _STATS_EXPORTER_H */
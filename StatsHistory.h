@@ -0,0 +1,277 @@
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <stdint.h>
+#include <string.h>
+#include "StatsExporter.h"
+#ifndef _STATS_HISTORY_H
+#define _STATS_HISTORY_H
+
+/*
+ * DeltaColumn - ring of signed values of one stat, zigzag encoded and stored with the smallest width (1, 2, 4 or
+ * 8 bytes) that fits the largest one kept. A write that does not fit widens the column, compact() narrows it
+ * again once the large values are overwritten. Memory is bounded by 8 bytes per slot.
+ */
+class DeltaColumn
+{
+  public:
+     /* first: the first value written, the column starts wide enough for it */
+     explicit DeltaColumn(uint32_t slots, int64_t first = 0) : _slots(slots), _width(widthOf(Varint::zigzag(first))),
+        _data(static_cast<size_t>(slots) * _width, 0) {}
+     void set(uint32_t slot, int64_t delta)
+     {
+        uint64_t value = Varint::zigzag(delta);
+        if (value > maxValue(_width)) widen(value);
+        switch (_width)
+        {
+          case 1: _data[slot] = static_cast<uint8_t>(value); break;
+          case 2: { uint16_t v = value; memcpy(&_data[slot * 2], &v, 2); break; }
+          case 4: { uint32_t v = value; memcpy(&_data[slot * 4], &v, 4); break; }
+          default: memcpy(&_data[slot * 8], &value, 8); break;
+        }
+     }
+     int64_t get(uint32_t slot) const { return Varint::unzigzag(raw(slot)); }
+     /* narrows the column to the width of its largest value */
+     void compact()
+     {
+        uint64_t max = 0;
+        for (uint32_t slot = 0; slot < _slots; ++slot) max = std::max(max, raw(slot));
+        uint32_t width = widthOf(max);
+        if (width < _width) resize(width);
+     }
+     uint32_t width() const { return _width; }
+     size_t memory() const { return _data.size(); }
+  private:
+     static uint64_t maxValue(uint32_t width) { return width >= 8 ? ~0ULL : (1ULL << (width * 8)) - 1; }
+     static uint32_t widthOf(uint64_t value)
+     {
+        uint32_t width = 1;
+        while (value > maxValue(width)) width *= 2;
+        return width;
+     }
+     uint64_t raw(uint32_t slot) const
+     {
+        switch (_width)
+        {
+          case 1: return _data[slot];
+          case 2: { uint16_t v; memcpy(&v, &_data[slot * 2], 2); return v; }
+          case 4: { uint32_t v; memcpy(&v, &_data[slot * 4], 4); return v; }
+          default: { uint64_t v; memcpy(&v, &_data[slot * 8], 8); return v; }
+        }
+     }
+     void widen(uint64_t value) { resize(widthOf(value)); }
+     void resize(uint32_t width)
+     {
+        std::vector<uint8_t> data(static_cast<size_t>(_slots) * width, 0);
+        for (uint32_t slot = 0; slot < _slots; ++slot)
+        {
+           uint64_t v = raw(slot);
+           memcpy(&data[static_cast<size_t>(slot) * width], &v, width); //little endian
+        }
+        _data.swap(data);
+        _width = width;
+     }
+     uint32_t _slots;
+     uint32_t _width;
+     std::vector<uint8_t> _data;
+};
+
+/*
+ * StatsHistory - last N intervals of every (statId, collectionId), fed as an exporter by the collector.
+ * One shared ring of interval lengths plus one DeltaColumn per stat, the memory depends on the number of stats
+ * and N, not on the uptime. Columns keep the change of the interval delta (delta of delta, as Gorilla does for
+ * timestamps), a stat moving at a steady rate costs 1 byte per interval. Queries walk back from the latest
+ * delta, newest interval first.
+ *    StatsHistory history(300);                 //5 minutes of 1 second intervals
+ *    aggregator.addExporter(&history);
+ *    history.rate(RX_STAT_ID, 0, 10);           //per second over the last 10 seconds
+ *    history.maxDelta(RX_STAT_ID, 0, 300);      //largest single interval change of the last 5 minutes
+ * TOTALS: the exporter gets running totals (stats.cpp StatsAggregator), the history keeps their differences, the
+ * first total of a series is its baseline (delta 0).
+ * DELTAS: the exporter gets the values of the interval (TLS aggregate()), kept as they are.
+ * The cost of an interval stays flat: at most newSeriesPerInterval series are created per call, a stat over the budget
+ * gets its series in one of the following intervals (its history starts there), and the columns are compacted a
+ * bounded number per call, every one once per lap of the ring.
+ * Collector thread only, queries must not run concurrently with exportStats().
+ */
+class StatsHistory : public StatsExporter
+{
+  public:
+     enum Input { TOTALS, DELTAS };
+
+     explicit StatsHistory(uint32_t intervals = 300, Input input = TOTALS, uint32_t newSeriesPerInterval = 8192)
+      : _slots(intervals ? intervals : 1), _input(input), _head(0), _filled(0), _interval(0), _intervalNs(_slots, 0),
+        _newSeriesPerInterval(newSeriesPerInterval ? newSeriesPerInterval : 1), _compactNext(0)
+     {
+     }
+
+     virtual void exportStats(uint64_t, uint64_t intervalNs, const ExportRecord* records, size_t count)
+     {
+        _head = (_head + 1) % _slots;
+        if (_filled < _slots) ++_filled;
+        ++_interval;
+        _intervalNs[_head] = intervalNs;
+        if (_positions.size() < count) _positions.resize(count, uint32_t(NONE));
+        uint32_t created = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+           const ExportRecord& record = records[i];
+           Series* found = getSeries(i, record, created);
+           if (!found) continue; //new series budget of this interval spent
+           Series& series = *found;
+           if (TOTALS == _input && 0 == series.interval) series.total = record.value; //first sight: baseline, delta 0
+           int64_t delta = TOTALS == _input ? static_cast<int64_t>(record.value - series.total) : static_cast<int64_t>(record.value);
+           series.total = TOTALS == _input ? record.value : series.total + record.value;
+           add(series, delta);
+        }
+        for (auto& series : _series)
+        {
+           if (series.interval != _interval) add(series, 0); //not reported this interval
+        }
+        size_t compact = std::min(_series.size(), _series.size() / _slots + 1); //every series once per lap of the ring
+        for (size_t i = 0; i < compact; ++i)
+        {
+           if (_compactNext >= _series.size()) _compactNext = 0;
+           _series[_compactNext++].column.compact();
+        }
+     }
+
+     /* change per second over the last seconds (or all the kept intervals if less), 0 if unknown */
+     double rate(uint64_t statId, uint32_t collectionId, double seconds) const
+     {
+        uint64_t covered = 0;
+        int64_t total = sum(statId, collectionId, seconds, &covered);
+        return covered ? total * 1e9 / covered : 0;
+     }
+     /* sum of the interval changes over the last seconds, covered (optional) gets the time it spans in ns */
+     int64_t sum(uint64_t statId, uint32_t collectionId, double seconds, uint64_t* covered = nullptr) const
+     {
+        int64_t total = 0;
+        forWindow(statId, collectionId, seconds, covered, [&total](int64_t delta) { total += delta; });
+        return total;
+     }
+     /* largest change of a single interval over the last seconds */
+     int64_t maxDelta(uint64_t statId, uint32_t collectionId, double seconds) const
+     {
+        bool first = true;
+        int64_t max = 0;
+        forWindow(statId, collectionId, seconds, nullptr, [&](int64_t delta)
+        {
+           if (first || delta > max) max = delta;
+           first = false;
+        });
+        return max;
+     }
+     /* delta of the interval age (0 = latest) */
+     int64_t delta(uint64_t statId, uint32_t collectionId, uint32_t age) const
+     {
+        int64_t value = 0;
+        uint32_t seen = 0;
+        forWindow(statId, collectionId, 1e300, nullptr, [&](int64_t delta) { if (seen++ == age) value = delta; });
+        return value;
+     }
+     uint32_t intervals() const { return _filled; }
+     size_t series() const { return _series.size(); }
+     /* bytes held by the delta columns and the interval ring */
+     size_t memory() const
+     {
+        size_t bytes = _intervalNs.size() * sizeof(uint64_t);
+        for (auto& series : _series) bytes += series.column.memory();
+        return bytes;
+     }
+
+  private:
+     static const uint32_t NONE = ~0u;
+
+     struct Key
+     {
+        uint64_t statId;
+        uint32_t collectionId;
+        bool operator==(const Key& other) const { return statId == other.statId && collectionId == other.collectionId; }
+     };
+     struct KeyHash
+     {
+        size_t operator()(const Key& key) const { return (key.statId * 0x9E3779B97F4A7C15ULL) ^ key.collectionId; }
+     };
+     struct Series
+     {
+        Series(const Key& k, uint32_t slots, int64_t first) : key(k), total(0), last(0), interval(0), column(slots, first) {}
+        Key key;
+        uint64_t total;    //< last running total (TOTALS) or sum of the deltas (DELTAS)
+        int64_t last;      //< delta of the latest interval
+        uint64_t interval; //< latest interval the series was written
+        DeltaColumn column; //< delta - previous delta, by interval
+     };
+
+     void add(Series& series, int64_t delta)
+     {
+        series.column.set(_head, delta - series.last);
+        series.last = delta;
+        series.interval = _interval;
+     }
+
+     /*
+      * the collectors export in a stable order, record i is usually the series it was the previous interval.
+      * nullptr for a new stat once created reached the budget of the interval
+      */
+     Series* getSeries(size_t position, const ExportRecord& record, uint32_t& created)
+     {
+        Key key = { record.statId, record.collectionId };
+        uint32_t idx = _positions[position];
+        if (NONE != idx && _series[idx].key == key) return &_series[idx];
+        auto it = _index.find(key);
+        if (it == _index.end())
+        {
+           if (created == _newSeriesPerInterval) return nullptr;
+           ++created;
+           idx = _series.size();
+           //DELTAS: the first delta is the value itself, the column starts wide enough for it. TOTALS: the first
+           //total is only the baseline, a series created late (over the budget) must not show its whole total as a spike
+           _series.push_back(Series(key, _slots, TOTALS == _input ? 0 : static_cast<int64_t>(record.value)));
+           _index[key] = idx;
+        }
+        else
+        {
+           idx = it->second;
+        }
+        _positions[position] = idx;
+        return &_series[idx];
+     }
+     const Series* find(uint64_t statId, uint32_t collectionId) const
+     {
+        Key key = { statId, collectionId };
+        auto it = _index.find(key);
+        return it == _index.end() ? nullptr : &_series[it->second];
+     }
+     /* f(delta) for the latest intervals, newest first, until they span seconds */
+     template <typename F>
+     void forWindow(uint64_t statId, uint32_t collectionId, double seconds, uint64_t* covered, F f) const
+     {
+        const Series* series = find(statId, collectionId);
+        uint64_t window = static_cast<uint64_t>(seconds * 1e9);
+        uint64_t spanned = 0;
+        int64_t delta = series ? series->last : 0;
+        for (uint32_t age = 0; series && age < _filled && spanned < window; ++age)
+        {
+           uint32_t slot = (_head + _slots - age) % _slots;
+           f(delta);
+           delta -= series->column.get(slot);
+           spanned += _intervalNs[slot];
+        }
+        if (covered) *covered = spanned;
+     }
+
+     uint32_t _slots;
+     Input _input;
+     uint32_t _head;      //< slot of the latest interval
+     uint32_t _filled;    //< intervals kept so far, up to _slots
+     uint64_t _interval;  //< intervals added so far
+     std::vector<uint64_t> _intervalNs; //< length of every kept interval
+     std::vector<Series> _series;
+     std::unordered_map<Key, uint32_t, KeyHash> _index;
+     std::vector<uint32_t> _positions;  //< export position -> series of the previous interval
+     uint32_t _newSeriesPerInterval;
+     size_t _compactNext;               //< next series to compact
+};
+
+#endif /* _STATS_HISTORY_H */
@@ -0,0 +1,240 @@
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+#ifndef _STATS_NAMES_H
+#define _STATS_NAMES_H
+
+/*
+ * StatsNames - interns hierarchical stat names ("rpc.server.requests") into dense stat ids, once, at registration
+ * time. The hot path stays integer only, the id is the statId of the atomic counters (stats.cpp) and the key of the
+ * thread local maps (TLS/stats.cpp):
+ *    static const uint32_t REQUESTS = StatsNames::getInstance().intern("rpc.server.requests");
+ *    GlobalStats requests(REQUESTS);
+ * The collector / exporters resolve ids and query the names:
+ *    StatsNames::getInstance().name(id);                                        //"rpc.server.requests"
+ *    StatsNames::getInstance().forEachMatch("rpc.*.requests", [](uint32_t id, const char* name) { ... });
+ *
+ * Ids are given in registration order from 0, a process should not mix interned ids and hand picked ids in the
+ * same range. Names are never removed, interning the same name again returns its id.
+ * Names live in arena chunks that never move, name(id) stays valid for the lifetime of the registry.
+ * Lookup is an open addressing table of ids (linear probing, load <= 1/2) with a 32 bit hash tag per slot, so a
+ * probe compares a string only on a tag match. Queries walk a sorted index of the ids, the ids interned since the
+ * previous query are sorted and merged into it, not the whole index.
+ * All the calls lock, forEach*() call f with the lock held: f must not intern.
+ */
+class StatsNames
+{
+  public:
+     static const uint32_t NOT_FOUND = 0xffffffff;
+
+     static StatsNames& getInstance()
+     {
+        static StatsNames names;
+        return names;
+     }
+
+     explicit StatsNames(uint32_t expected = 1024) : _count(0), _sorted(0), _used(CHUNK_SIZE)
+     {
+        reserve(expected);
+     }
+     StatsNames(const StatsNames&) = delete;
+     StatsNames& operator=(const StatsNames&) = delete;
+
+     uint32_t intern(const char* name, size_t length)
+     {
+        uint64_t hash = hashOf(name, length);
+        std::lock_guard<std::mutex> lck (_mtx);
+        uint64_t idx = probe(name, length, hash);
+        if (_slots[idx].id != NOT_FOUND) return _slots[idx].id;
+        if ((_count + 1) * 2 > _slots.size())
+        {
+           reserve(_count + 1);
+           idx = probe(name, length, hash);
+        }
+        uint32_t id = _count++;
+        _names.push_back(store(name, length));
+        _lengths.push_back(static_cast<uint32_t>(length));
+        _slots[idx].id = id;
+        _slots[idx].tag = static_cast<uint32_t>(hash);
+        return id;
+     }
+     uint32_t intern(const std::string& name) { return intern(name.data(), name.size()); }
+
+     /* NOT_FOUND if the name was never interned */
+     uint32_t find(const char* name, size_t length) const
+     {
+        uint64_t hash = hashOf(name, length);
+        std::lock_guard<std::mutex> lck (_mtx);
+        return _slots[probe(name, length, hash)].id;
+     }
+     uint32_t find(const std::string& name) const { return find(name.data(), name.size()); }
+
+     /* nullptr for an id that was not interned */
+     const char* name(uint32_t id) const
+     {
+        std::lock_guard<std::mutex> lck (_mtx);
+        return id < _count ? _names[id] : nullptr;
+     }
+     uint32_t size() const
+     {
+        std::lock_guard<std::mutex> lck (_mtx);
+        return _count;
+     }
+
+     /* f(id, name) for every name starting with prefix, in name order */
+     template <typename F>
+     void forEachPrefix(const std::string& prefix, F f) const
+     {
+        std::lock_guard<std::mutex> lck (_mtx);
+        for (size_t i = lowerBound(prefix); i < _index.size(); ++i)
+        {
+           uint32_t id = _index[i];
+           if (_lengths[id] < prefix.size() || 0 != memcmp(_names[id], prefix.data(), prefix.size())) break;
+           f(id, static_cast<const char*>(_names[id]));
+        }
+     }
+     /* f(id, name) for every name matching the glob pattern (see match()), in name order */
+     template <typename F>
+     void forEachMatch(const std::string& pattern, F f) const
+     {
+        std::string prefix = pattern.substr(0, pattern.find_first_of("*?"));
+        forEachPrefix(prefix, [&](uint32_t id, const char* name)
+        {
+           if (match(pattern.c_str() + prefix.size(), name + prefix.size())) f(id, name);
+        });
+     }
+     /*
+      * glob over the '.' separated segments of a name:
+      *    ?   one character of a segment
+      *    *   any run of characters of a segment, "rpc.*.requests" matches rpc.server.requests not rpc.a.b.requests
+      *    **  any run of characters, segments included, "rpc.**" matches every name under rpc.
+      */
+     static bool match(const char* pattern, const char* name)
+     {
+        while (*pattern)
+        {
+           if ('*' == *pattern)
+           {
+              bool segments = '*' == pattern[1];
+              const char* rest = pattern + (segments ? 2 : 1);
+              for (const char* tail = name; ; ++tail)
+              {
+                 if (match(rest, tail)) return true;
+                 if (!*tail || (!segments && '.' == *tail)) return false;
+              }
+           }
+           if (!*name || ('?' == *pattern ? '.' == *name : *pattern != *name)) return false;
+           ++pattern;
+           ++name;
+        }
+        return !*name;
+     }
+
+     /* bytes held: names, per id arrays, lookup table and sorted index */
+     uint64_t memory() const
+     {
+        std::lock_guard<std::mutex> lck (_mtx);
+        return _chunks.size() * CHUNK_SIZE + _names.capacity() * sizeof(const char*)
+             + _lengths.capacity() * sizeof(uint32_t) + _slots.size() * sizeof(Slot) + _index.capacity() * sizeof(uint32_t);
+     }
+
+  private:
+     static const size_t CHUNK_SIZE = 64 * 1024;
+
+     struct Slot
+     {
+        uint32_t id;  //< NOT_FOUND when empty
+        uint32_t tag; //< low bits of the name hash
+     };
+
+     /* 8 bytes at a time multiply / xorshift, the high bits pick the slot, the low bits are the tag */
+     static uint64_t hashOf(const char* name, size_t length)
+     {
+        uint64_t hash = length * 0x9E3779B97F4A7C15ULL;
+        for (; length >= 8; name += 8, length -= 8)
+        {
+           uint64_t word;
+           memcpy(&word, name, 8);
+           hash = ((hash ^ word) * 0xBF58476D1CE4E5B9ULL);
+           hash ^= hash >> 29;
+        }
+        uint64_t word = 0;
+        memcpy(&word, name, length);
+        hash = (hash ^ word) * 0x94D049BB133111EBULL;
+        return hash ^ (hash >> 31);
+     }
+     /* slot of the name, or the empty slot where it goes */
+     uint64_t probe(const char* name, size_t length, uint64_t hash) const
+     {
+        uint64_t mask = _slots.size() - 1;
+        uint32_t tag = static_cast<uint32_t>(hash);
+        for (uint64_t idx = (hash >> 32) & mask; ; idx = (idx + 1) & mask)
+        {
+           const Slot& slot = _slots[idx];
+           if (NOT_FOUND == slot.id) return idx;
+           if (slot.tag == tag && _lengths[slot.id] == length && 0 == memcmp(_names[slot.id], name, length)) return idx;
+        }
+     }
+     /* capacity for count names at load <= 1/2, rehashes the interned names */
+     void reserve(uint32_t count)
+     {
+        uint64_t capacity = 16;
+        while (capacity < 2ULL * count) capacity *= 2;
+        if (capacity <= _slots.size()) return;
+        std::vector<Slot> slots(capacity, Slot{NOT_FOUND, 0});
+        _slots.swap(slots);
+        for (uint32_t id = 0; id < _count; ++id)
+        {
+           uint64_t hash = hashOf(_names[id], _lengths[id]);
+           uint64_t idx = probe(_names[id], _lengths[id], hash);
+           _slots[idx].id = id;
+           _slots[idx].tag = static_cast<uint32_t>(hash);
+        }
+     }
+     /* nul terminated copy in the arena, a name larger than a chunk gets its own chunk */
+     const char* store(const char* name, size_t length)
+     {
+        if (_used + length + 1 > CHUNK_SIZE)
+        {
+           _chunks.push_back(std::unique_ptr<char[]>(new char[length + 1 > CHUNK_SIZE ? length + 1 : CHUNK_SIZE]));
+           _used = 0;
+        }
+        char* copy = _chunks.back().get() + _used;
+        memcpy(copy, name, length);
+        copy[length] = 0;
+        _used = length + 1 > CHUNK_SIZE ? CHUNK_SIZE : _used + length + 1;
+        return copy;
+     }
+     /* first position of the sorted index not below prefix, sorts in the ids interned since the last query */
+     size_t lowerBound(const std::string& prefix) const
+     {
+        if (_sorted < _count)
+        {
+           for (uint32_t id = _sorted; id < _count; ++id) _index.push_back(id);
+           auto less = [this](uint32_t a, uint32_t b) { return strcmp(_names[a], _names[b]) < 0; };
+           std::sort(_index.begin() + _sorted, _index.end(), less);
+           std::inplace_merge(_index.begin(), _index.begin() + _sorted, _index.end(), less);
+           _sorted = _count;
+        }
+        return std::lower_bound(_index.begin(), _index.end(), prefix, [this](uint32_t id, const std::string& value)
+        {
+           return strcmp(_names[id], value.c_str()) < 0;
+        }) - _index.begin();
+     }
+
+     mutable std::mutex _mtx;
+     uint32_t _count;
+     std::vector<const char*> _names;  //< by id
+     std::vector<uint32_t> _lengths;   //< by id
+     std::vector<Slot> _slots;
+     mutable std::vector<uint32_t> _index; //< ids in name order, the first _sorted of them
+     mutable uint32_t _sorted;
+     std::vector<std::unique_ptr<char[]> > _chunks;
+     size_t _used; //< bytes used in the last chunk
+};
+
+#endif /* _STATS_NAMES_H */
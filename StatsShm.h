@@ -0,0 +1,212 @@
+#include <atomic>
+#include <string>
+#include <vector>
+#include <system_error>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "StatsExporter.h"
+#ifndef _STATS_SHM_H
+#define _STATS_SHM_H
+
+/*
+ * Shared memory stats segment: the collector publishes every interval in a mmap'd file (/dev/shm/... is POSIX
+ * shared memory on linux), out of process readers map it read only.
+ *
+ *   ShmHeader | ShmRecord[capacity]
+ *
+ * The segment is protected by a seqlock: the writer makes sequence odd, writes the records, makes it even again.
+ * A reader copies the records and retries if sequence was odd or changed meanwhile. The writer never waits and
+ * never does a syscall, a slow reader only costs itself retries.
+ * Layout changes bump SHM_VERSION, readers refuse versions they do not know.
+ */
+static const uint32_t SHM_MAGIC = 0x4d485353;   //"SSHM"
+static const uint32_t SHM_VERSION = 1;
+
+struct ShmRecord
+{
+  uint64_t statId;
+  uint32_t collectionId;
+  uint32_t kind;
+  uint64_t value;
+};
+
+struct alignas(64) ShmHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t headerSize;
+  uint32_t recordSize;
+  uint64_t capacity;                //< records the segment can hold
+  alignas(64) std::atomic<uint64_t> sequence; //< seqlock, odd while the writer is publishing
+  uint64_t timestampNs;             //< end of the published interval (steady clock of the writer)
+  uint64_t intervalNs;
+  uint64_t count;                   //< valid records
+  uint64_t dropped;                 //< records of the interval that did not fit
+  uint64_t checksum;                //< sum of (statId ^ value) of the valid records
+};
+
+inline uint64_t shmChecksum(const ShmRecord* records, uint64_t count)
+{
+  uint64_t sum = 0;
+  for (uint64_t i = 0; i < count; ++i) sum += records[i].statId ^ records[i].value;
+  return sum;
+}
+
+/*
+ * ShmExporter - publishes every aggregated interval in the segment at path, created (or reused) with room for
+ * capacity records.
+ *    ShmExporter shm("/dev/shm/localstats", 100000);
+ *    aggregator.addExporter(&shm);
+ */
+class ShmExporter : public StatsExporter
+{
+  public:
+     ShmExporter(const std::string& path, uint64_t capacity) : _size(sizeof(ShmHeader) + capacity * sizeof(ShmRecord))
+     {
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) throw std::system_error(errno, std::generic_category(), path);
+        if (::ftruncate(fd, _size) != 0)
+        {
+           int error = errno;
+           ::close(fd);
+           throw std::system_error(error, std::generic_category(), path);
+        }
+        void* base = ::mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (MAP_FAILED == base) throw std::system_error(errno, std::generic_category(), path);
+        _header = static_cast<ShmHeader*>(base);
+        _records = reinterpret_cast<ShmRecord*>(_header + 1);
+
+        /* readers check magic and version last, they see a zeroed (not yet valid) header until then */
+        _header->magic = 0;
+        _header->headerSize = sizeof(ShmHeader);
+        _header->recordSize = sizeof(ShmRecord);
+        _header->capacity = capacity;
+        _header->sequence.store(_header->sequence.load(std::memory_order_relaxed) & ~1ULL, std::memory_order_relaxed);
+        _header->count = 0;
+        _header->dropped = 0;
+        _header->checksum = 0;
+        _header->version = SHM_VERSION;
+        std::atomic_thread_fence(std::memory_order_release);
+        _header->magic = SHM_MAGIC;
+     }
+     virtual ~ShmExporter() { ::munmap(_header, _size); }
+     ShmExporter(const ShmExporter&) = delete;
+     ShmExporter& operator=(const ShmExporter&) = delete;
+
+     virtual void exportStats(uint64_t timestampNs, uint64_t intervalNs, const ExportRecord* records, size_t count)
+     {
+        uint64_t valid = count < _header->capacity ? count : _header->capacity;
+        uint64_t sequence = _header->sequence.load(std::memory_order_relaxed);
+        _header->sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        uint64_t checksum = 0;
+        for (uint64_t i = 0; i < valid; ++i)
+        {
+           ShmRecord& record = _records[i];
+           record.statId = records[i].statId;
+           record.collectionId = records[i].collectionId;
+           record.kind = records[i].kind;
+           record.value = records[i].value;
+           checksum += record.statId ^ record.value;
+        }
+        _header->timestampNs = timestampNs;
+        _header->intervalNs = intervalNs;
+        _header->count = valid;
+        _header->dropped = count - valid;
+        _header->checksum = checksum;
+        _header->sequence.store(sequence + 2, std::memory_order_release);
+     }
+     uint64_t sequence() const { return _header->sequence.load(std::memory_order_relaxed); }
+  private:
+     size_t _size;
+     ShmHeader* _header;
+     ShmRecord* _records;
+};
+
+/* ShmReader - maps a segment read only and copies consistent snapshots out of it, no syscall per read */
+class ShmReader
+{
+  public:
+     struct Snapshot
+     {
+        Snapshot() : sequence(0), timestampNs(0), intervalNs(0), dropped(0), checksum(0), retries(0) {}
+        uint64_t sequence;
+        uint64_t timestampNs;
+        uint64_t intervalNs;
+        uint64_t dropped;
+        uint64_t checksum;
+        uint64_t retries;              //< torn reads retried for this snapshot
+        std::vector<ShmRecord> records;
+     };
+
+     explicit ShmReader(const std::string& path) : _size(0), _header(nullptr), _records(nullptr)
+     {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) throw std::system_error(errno, std::generic_category(), path);
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(ShmHeader))
+        {
+           ::close(fd);
+           throw std::system_error(EINVAL, std::generic_category(), path + ": not a stats segment");
+        }
+        _size = st.st_size;
+        void* base = ::mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (MAP_FAILED == base) throw std::system_error(errno, std::generic_category(), path);
+        _header = static_cast<const ShmHeader*>(base);
+        _records = reinterpret_cast<const ShmRecord*>(_header + 1);
+     }
+     ~ShmReader() { ::munmap(const_cast<ShmHeader*>(_header), _size); }
+     ShmReader(const ShmReader&) = delete;
+     ShmReader& operator=(const ShmReader&) = delete;
+
+     /* false until the writer initialized the segment, or if its layout version is unknown */
+     bool valid() const
+     {
+        if (SHM_MAGIC != *reinterpret_cast<const volatile uint32_t*>(&_header->magic)) return false;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return SHM_VERSION == _header->version && sizeof(ShmHeader) == _header->headerSize
+            && sizeof(ShmRecord) == _header->recordSize
+            && sizeof(ShmHeader) + _header->capacity * sizeof(ShmRecord) <= _size;
+     }
+     /* latest published sequence, even when stable */
+     uint64_t sequence() const { return _header->sequence.load(std::memory_order_acquire); }
+
+     /* copies the latest published interval, false if the segment is not valid or after maxRetries torn reads */
+     bool read(Snapshot& snapshot, uint32_t maxRetries = 1000)
+     {
+        if (!valid()) return false;
+        snapshot.records.reserve(_header->capacity);
+        for (snapshot.retries = 0; snapshot.retries <= maxRetries; ++snapshot.retries)
+        {
+           uint64_t begin = _header->sequence.load(std::memory_order_acquire);
+           if (begin & 1) continue;
+           uint64_t count = _header->count;
+           if (count > _header->capacity) continue;
+           snapshot.timestampNs = _header->timestampNs;
+           snapshot.intervalNs = _header->intervalNs;
+           snapshot.dropped = _header->dropped;
+           snapshot.checksum = _header->checksum;
+           snapshot.records.assign(_records, _records + count);
+           std::atomic_thread_fence(std::memory_order_acquire);
+           if (_header->sequence.load(std::memory_order_relaxed) == begin)
+           {
+              snapshot.sequence = begin;
+              return true;
+           }
+        }
+        return false;
+     }
+  private:
+     size_t _size;
+     const ShmHeader* _header;
+     const ShmRecord* _records;
+};
+
+#endif /* _STATS_SHM_H */
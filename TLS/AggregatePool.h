@@ -0,0 +1,164 @@
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#ifndef _AGGREGATE_POOL_H
+#define _AGGREGATE_POOL_H
+
+/* cpu -> numa node, read from /sys/devices/system/node, a single node 0 when it is not there */
+class NumaTopology
+{
+  public:
+     NumaTopology()
+     {
+        for (uint32_t node = 0; ; ++node)
+        {
+           char path[64];
+           snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+           FILE* file = fopen(path, "r");
+           if (nullptr == file) break;
+           char list[4096] = { 0 };
+           if (fgets(list, sizeof(list), file)) addCpus(node, list);
+           fclose(file);
+        }
+        if (_cpus.empty()) _cpus.push_back(std::vector<int>());
+     }
+     uint32_t nodes() const { return _cpus.size(); }
+     /* 0 for an unknown cpu (e.g. sched_getcpu failed) */
+     uint32_t nodeOfCpu(int cpu) const
+     {
+        return cpu >= 0 && static_cast<size_t>(cpu) < _nodeOfCpu.size() ? _nodeOfCpu[cpu] : 0;
+     }
+     const std::vector<int>& cpusOfNode(uint32_t node) const { return _cpus[node]; }
+  private:
+     /* cpulist format: "0-3,8-11" */
+     void addCpus(uint32_t node, const char* list)
+     {
+        _cpus.resize(node + 1);
+        const char* p = list;
+        while (*p >= '0' && *p <= '9')
+        {
+           char* end = nullptr;
+           int first = strtol(p, &end, 10);
+           int last = first;
+           if ('-' == *end) last = strtol(end + 1, &end, 10);
+           for (int cpu = first; cpu <= last; ++cpu)
+           {
+              _cpus[node].push_back(cpu);
+              if (static_cast<size_t>(cpu) >= _nodeOfCpu.size()) _nodeOfCpu.resize(cpu + 1, 0);
+              _nodeOfCpu[cpu] = node;
+           }
+           p = ',' == *end ? end + 1 : end;
+        }
+     }
+     std::vector<std::vector<int> > _cpus; //< by node
+     std::vector<uint32_t> _nodeOfCpu;
+};
+
+/*
+ * AggregatePool - worker threads for the partial merges of aggregate().
+ *    AggregatePool pool(4, true);
+ *    pool.run(tasks, [&](uint32_t task) { ... });   //task i runs on worker i % workers(), blocks until all ran
+ * Tasks are assigned statically, so a task index always runs on the same worker (and the same numa node): the
+ * worker that built partial i also merges into it during the reduction.
+ * numa: workers are split in contiguous blocks over the numa nodes and pinned to the cpus of their node, neighbour
+ * workers share a node so the first reduction rounds stay node local.
+ * run() is called by one thread at a time (aggregate() holds _collectMtx).
+ */
+class AggregatePool
+{
+  public:
+     typedef std::function<void(uint32_t task)> Task;
+
+     explicit AggregatePool(uint32_t workers, bool numa = false)
+      : _numa(numa), _count(std::max(1u, workers)), _task(nullptr), _tasks(0), _generation(0), _done(0), _stopping(false)
+     {
+        for (uint32_t worker = 0; worker < _count; ++worker)
+        {
+           _workerNode.push_back(numa ? worker * _topology.nodes() / _count : 0);
+        }
+        for (uint32_t worker = 0; worker < _count; ++worker)
+        {
+           _threads.push_back(std::thread(&AggregatePool::work, this, worker));
+        }
+     }
+     ~AggregatePool()
+     {
+        {
+           std::lock_guard<std::mutex> lck (_mtx);
+           _stopping = true;
+        }
+        _start.notify_all();
+        for (auto& thread : _threads) thread.join();
+     }
+     AggregatePool(const AggregatePool&) = delete;
+     AggregatePool& operator=(const AggregatePool&) = delete;
+
+     void run(uint32_t tasks, const Task& task)
+     {
+        std::unique_lock<std::mutex> lck (_mtx);
+        _task = &task;
+        _tasks = tasks;
+        _done = 0;
+        ++_generation;
+        _start.notify_all();
+        _finished.wait(lck, [this]() { return _done == _count; });
+        _task = nullptr;
+     }
+     uint32_t workers() const { return _count; }
+     /* numa node of the worker running task % workers() */
+     uint32_t workerNode(uint32_t worker) const { return _workerNode[worker]; }
+     bool numa() const { return _numa; }
+     const NumaTopology& topology() const { return _topology; }
+
+  private:
+     void work(uint32_t worker)
+     {
+        if (_numa) pin(_topology.cpusOfNode(_workerNode[worker]));
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lck (_mtx);
+        while (true)
+        {
+           _start.wait(lck, [&]() { return _stopping || _generation != seen; });
+           if (_stopping) return;
+           seen = _generation;
+           const Task* task = _task;
+           uint32_t tasks = _tasks;
+           lck.unlock();
+           for (uint32_t i = worker; i < tasks; i += _count) (*task)(i);
+           lck.lock();
+           if (++_done == _count) _finished.notify_one();
+        }
+     }
+     static void pin(const std::vector<int>& cpus)
+     {
+        if (cpus.empty()) return;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus) CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set); //best effort, runs unpinned on error
+     }
+
+     NumaTopology _topology;
+     bool _numa;
+     uint32_t _count;
+     std::vector<uint32_t> _workerNode;
+     std::vector<std::thread> _threads;
+     std::mutex _mtx;
+     std::condition_variable _start;
+     std::condition_variable _finished;
+     const Task* _task;
+     uint32_t _tasks;
+     uint64_t _generation;
+     uint32_t _done;
+     bool _stopping;
+};
+
+#endif /* _AGGREGATE_POOL_H */
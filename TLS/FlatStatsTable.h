@@ -0,0 +1,350 @@
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <chrono>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdint.h>
+#ifndef _FLAT_STATS_TABLE_H
+#define _FLAT_STATS_TABLE_H
+
+/*
+ * FlatStatsTable - open addressing (linear probing) hash table keyed on the 64 bit
+ * stat id, counters are stored inline in the slot array so a lookup is one multiply
+ * and (usually) one cache line.
+ *
+ * Threading model is the one of the per thread StatsMap:
+ *   - only the owner thread inserts keys and updates counters
+ *   - the collector may walk the table (forEach) at any time
+ * A new key is published by a release store of the slot key after the counter is ready,
+ * so the walker never sees half inserted slots. Growth moves slots to a new array, it is
+ * done under _growMtx which is also held by forEach, so the collector never reads a
+ * freed array and never sees a counter twice. The owner takes the lock only when growing.
+ *
+ * Slot arrays are cache line aligned, so two threads tables never share a line, and a slot is padded to a power
+ * of two so it never straddles two lines.
+ *
+ * Every slot also has a collector side value C (e.g. the last value the collector has seen), kept in a
+ * separate array so the collector writes never land on the cache lines the owner is updating.
+ *
+ * Dirty tracking: update() sets the dirty byte of the slot after the value is written (a plain release store, no
+ * read modify write on the owner hot path), the bytes are in their own array. forEachDirty() looks at the bytes
+ * with relaxed loads (never a plain read, the owner may be storing), exchanges the set ones with 0 (acquire) and
+ * visits only those slots, so a collection costs capacity byte loads plus the changed slots. An update after the
+ * exchange sets the byte again for the next pass, nothing is missed. The collector can keep slots visited every
+ * pass (sticky, e.g. gauges) in its own bitmap.
+ *
+ * Self instrumentation: size() and memory() can be read from any thread, allocations() and lockWaitNs() count the
+ * slot array allocations and the time spent waiting for a contended _growMtx (owner growing while the collector
+ * walks, or the other way round) over all the tables, a contended lock only costs two clock reads.
+ *
+ * EMPTY_KEY (~0) is reserved and can not be used as stat id.
+ */
+template <typename T, typename C = uint64_t>
+class FlatStatsTable
+{
+  public:
+     static const uint64_t EMPTY_KEY = ~0ULL;
+     static const uint64_t DEFAULT_CAPACITY = 8192; //< 4k stat ids without growing
+
+     static const size_t CACHE_LINE = 64;
+
+     struct alignas(sizeof(T) + 8 <= 16 ? 16 : sizeof(T) + 8 <= 32 ? 32 : CACHE_LINE) Slot
+     {
+        Slot() : key(EMPTY_KEY) {}
+        std::atomic<uint64_t> key;
+        T value;
+     };
+
+     explicit FlatStatsTable(uint64_t capacity = DEFAULT_CAPACITY)
+      : _slots(nullptr), _shadow(nullptr), _dirty(nullptr), _sticky(nullptr), _mask(0), _shift(0), _seed(nextSeed()), _size(0), _generation(0), _bytes(0)
+     {
+        allocate(roundCapacity(capacity));
+     }
+     ~FlatStatsTable()
+     {
+        release(_slots, _shadow, _dirty, _sticky, capacity());
+     }
+     FlatStatsTable(const FlatStatsTable& other)
+      : _slots(nullptr), _shadow(nullptr), _dirty(nullptr), _sticky(nullptr), _mask(0), _shift(0), _seed(nextSeed()), _size(0), _generation(0), _bytes(0)
+     {
+        allocate(other.capacity());
+        const_cast<FlatStatsTable&>(other).forEachShadow([this](uint64_t key, T& value, C& shadow)
+        {
+           uint64_t idx = findOrInsert(key);
+           _slots[idx].value = value;
+           _shadow[idx] = shadow;
+           markDirty(idx);
+        });
+     }
+     FlatStatsTable(FlatStatsTable&& other)
+      : _slots(other._slots), _shadow(other._shadow), _dirty(other._dirty), _sticky(other._sticky), _mask(other._mask)
+      , _shift(other._shift), _seed(other._seed), _size(other.size()), _generation(0), _bytes(other.memory())
+     {
+        other._size.store(0, std::memory_order_relaxed);
+        ++other._generation;
+        other.allocate(16); //moved from table stays usable
+     }
+     FlatStatsTable& operator=(FlatStatsTable&& other)
+     {
+        if (this != &other)
+        {
+           std::swap(_slots, other._slots);
+           std::swap(_shadow, other._shadow);
+           std::swap(_dirty, other._dirty);
+           std::swap(_sticky, other._sticky);
+           std::swap(_mask, other._mask);
+           std::swap(_shift, other._shift);
+           std::swap(_seed, other._seed);
+           uint64_t size = other.size();
+           other._size.store(this->size(), std::memory_order_relaxed);
+           _size.store(size, std::memory_order_relaxed);
+           uint64_t bytes = other.memory();
+           other._bytes.store(memory(), std::memory_order_relaxed);
+           _bytes.store(bytes, std::memory_order_relaxed);
+           ++_generation;
+           ++other._generation;
+        }
+        return *this;
+     }
+     FlatStatsTable& operator=(const FlatStatsTable& other) = delete;
+
+     /* find or insert, owner thread only */
+     T& operator[](uint64_t key)
+     {
+        uint64_t idx = findOrInsert(key); //may grow, _slots must be read after it
+        return _slots[idx].value;
+     }
+     /* find or insert and update the value with f(T&), then mark the slot dirty, owner thread only */
+     template <typename F>
+     void update(uint64_t key, F f)
+     {
+        uint64_t idx = findOrInsert(key);
+        f(_slots[idx].value);
+        markDirty(idx);
+     }
+     /* marks the slot of a value returned by operator[] dirty, after updating it through the reference */
+     void markDirty(const T& value)
+     {
+        const char* slot = reinterpret_cast<const char*>(&value) - offsetof(Slot, value);
+        markDirty(reinterpret_cast<const Slot*>(slot) - _slots);
+     }
+     /* changes whenever slots move, a cached T& / T* is only valid while the generation is unchanged */
+     uint64_t generation() const { return _generation; }
+
+     /* visit every used slot as f(key, value), safe to call from the collector */
+     template <typename F>
+     void forEach(F f)
+     {
+        forEachShadow([&f](uint64_t key, T& value, C&) { f(key, value); });
+     }
+     /* visit every used slot as f(key, value, collectorValue), collector only */
+     template <typename F>
+     void forEachShadow(F f)
+     {
+        lockGrow();
+        std::lock_guard<std::mutex> lck (_growMtx, std::adopt_lock);
+        for (uint64_t i = 0; i <= _mask; ++i)
+        {
+           uint64_t key = _slots[i].key.load(std::memory_order_acquire);
+           if (key != EMPTY_KEY) f(key, _slots[i].value, _shadow[i]);
+        }
+     }
+     /*
+      * visit the slots updated since the previous call, and the sticky ones, as f(key, value, collectorValue),
+      * f returns true to keep the slot sticky (visited every call). Collector only
+      */
+     template <typename F>
+     void forEachDirty(F f)
+     {
+        lockGrow();
+        std::lock_guard<std::mutex> lck (_growMtx, std::adopt_lock);
+        for (uint64_t word = 0; word < dirtyWords(); ++word)
+        {
+           uint64_t bits = _sticky[word];
+           std::atomic<uint8_t>* dirty = &_dirty[word * 64];
+           uint64_t set = 0;
+           for (uint64_t i = 0; i < 64; ++i) set |= uint64_t(dirty[i].load(std::memory_order_relaxed)) << i; //quick look, bytes are 0 or 1
+           while (set)
+           {
+              uint64_t i = __builtin_ctzll(set);
+              set &= set - 1;
+              if (dirty[i].exchange(0, std::memory_order_acquire)) bits |= 1ULL << i;
+           }
+           uint64_t sticky = 0;
+           while (bits)
+           {
+              uint64_t idx = word * 64 + __builtin_ctzll(bits);
+              bits &= bits - 1;
+              uint64_t key = _slots[idx].key.load(std::memory_order_acquire);
+              if (key != EMPTY_KEY && f(key, _slots[idx].value, _shadow[idx])) sticky |= 1ULL << (idx & 63);
+           }
+           _sticky[word] = sticky;
+        }
+     }
+     template <typename F>
+     void forEach(F f) const
+     {
+        const_cast<FlatStatsTable*>(this)->forEach(
+            [&f](uint64_t key, T& value) { f(key, static_cast<const T&>(value)); });
+     }
+
+     uint64_t size() const { return _size.load(std::memory_order_relaxed); }
+     /* heap bytes held: slots, collector side values, dirty bytes and sticky bits */
+     uint64_t memory() const { return _bytes.load(std::memory_order_relaxed); }
+     uint64_t capacity() const { return _mask + 1; }
+
+     /* slot arrays allocated by all the tables since the start */
+     static uint64_t allocations() { return allocationCount().load(std::memory_order_relaxed); }
+     /* time (ns) all the tables waited on a contended _growMtx since the start */
+     static uint64_t lockWaitNs() { return lockWaitCount().load(std::memory_order_relaxed); }
+
+  private:
+     /* max load factor 0.7, linear probing degrades quickly above that */
+     bool needGrow() const { return (size() + 1) * 10 > capacity() * 7; }
+
+     static uint64_t roundCapacity(uint64_t capacity)
+     {
+        uint64_t cap = 16;
+        while (cap < capacity) cap <<= 1;
+        return cap;
+     }
+     /*
+      * fibonacci hashing, sequential stat ids end up spread over the whole table.
+      * The key is xored with a per table seed: copying a table into a smaller one with the same hash (aggregate()
+      * walks the thread tables in slot order) inserts the keys sorted by home slot, they pile up in one cluster
+      * and every insert probes to its end (quadratic).
+      */
+     uint64_t slotIndex(uint64_t key) const
+     {
+        return ((key ^ _seed) * 0x9E3779B97F4A7C15ULL) >> _shift;
+     }
+     static uint64_t nextSeed()
+     {
+        static std::atomic<uint64_t> tables(0);
+        return (tables.fetch_add(1, std::memory_order_relaxed) + 1) * 0xBF58476D1CE4E5B9ULL;
+     }
+     uint64_t findOrInsert(uint64_t key)
+     {
+        uint64_t idx = slotIndex(key);
+        while (true)
+        {
+           uint64_t current = _slots[idx].key.load(std::memory_order_relaxed);
+           if (current == key) return idx;
+           if (current == EMPTY_KEY) return insert(key, idx);
+           idx = (idx + 1) & _mask;
+        }
+     }
+     static std::atomic<uint64_t>& allocationCount()
+     {
+        static std::atomic<uint64_t> count(0);
+        return count;
+     }
+     static std::atomic<uint64_t>& lockWaitCount()
+     {
+        static std::atomic<uint64_t> ns(0);
+        return ns;
+     }
+     /* try first, the clock is only read when the lock is contended */
+     void lockGrow()
+     {
+        if (_growMtx.try_lock()) return;
+        auto begin = std::chrono::steady_clock::now();
+        _growMtx.lock();
+        lockWaitCount().fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now() - begin).count(), std::memory_order_relaxed);
+     }
+     static void* alignedAlloc(size_t size)
+     {
+        allocationCount().fetch_add(1, std::memory_order_relaxed);
+        void* ptr = nullptr;
+        if (::posix_memalign(&ptr, CACHE_LINE, size) != 0) throw std::bad_alloc();
+        return ptr;
+     }
+     static uint64_t dirtyWords(uint64_t capacity) { return (capacity + 63) / 64; }
+     uint64_t dirtyWords() const { return dirtyWords(capacity()); }
+     /* always stored, never skipped when the byte looks set: the store orders the value update before the flag */
+     void markDirty(uint64_t idx) { _dirty[idx].store(1, std::memory_order_release); }
+     static void release(Slot* slots, C* shadow, std::atomic<uint8_t>* dirty, uint64_t* sticky, uint64_t capacity)
+     {
+        for (uint64_t i = 0; i < capacity; ++i)
+        {
+           slots[i].~Slot();
+           shadow[i].~C();
+        }
+        ::free(slots);
+        ::free(shadow);
+        ::free(dirty);
+        ::free(sticky);
+     }
+     void allocate(uint64_t capacity)
+     {
+        _slots = static_cast<Slot*>(alignedAlloc(sizeof(Slot) * capacity));
+        _shadow = static_cast<C*>(alignedAlloc(sizeof(C) * capacity));
+        _dirty = static_cast<std::atomic<uint8_t>*>(alignedAlloc(dirtyWords(capacity) * 64));
+        _sticky = static_cast<uint64_t*>(alignedAlloc(sizeof(uint64_t) * dirtyWords(capacity)));
+        for (uint64_t i = 0; i < capacity; ++i)
+        {
+           new (&_slots[i]) Slot();
+           new (&_shadow[i]) C();
+        }
+        for (uint64_t i = 0; i < dirtyWords(capacity) * 64; ++i) new (&_dirty[i]) std::atomic<uint8_t>(0);
+        for (uint64_t i = 0; i < dirtyWords(capacity); ++i) _sticky[i] = 0;
+        _mask = capacity - 1;
+        _shift = 64;
+        for (uint64_t cap = capacity; cap > 1; cap >>= 1) --_shift;
+        _bytes.store(capacity * (sizeof(Slot) + sizeof(C)) + dirtyWords(capacity) * (64 + sizeof(uint64_t)),
+                     std::memory_order_relaxed);
+     }
+
+     __attribute__((noinline)) uint64_t insert(uint64_t key, uint64_t idx)
+     {
+        if (needGrow())
+        {
+           grow();
+           return findOrInsert(key);
+        }
+        _size.store(size() + 1, std::memory_order_relaxed); //single writer, no locked add
+        _slots[idx].key.store(key, std::memory_order_release);
+        return idx;
+     }
+     void grow()
+     {
+        lockGrow();
+        std::lock_guard<std::mutex> lck (_growMtx, std::adopt_lock);
+        Slot* old = _slots;
+        C* oldShadow = _shadow;
+        std::atomic<uint8_t>* oldDirty = _dirty;
+        uint64_t* oldSticky = _sticky;
+        uint64_t oldCapacity = capacity();
+        allocate(oldCapacity * 2);
+        for (uint64_t i = 0; i < oldCapacity; ++i)
+        {
+           uint64_t key = old[i].key.load(std::memory_order_relaxed);
+           if (key == EMPTY_KEY) continue;
+           uint64_t idx = slotIndex(key);
+           while (_slots[idx].key.load(std::memory_order_relaxed) != EMPTY_KEY) idx = (idx + 1) & _mask;
+           _slots[idx].value = old[i].value;
+           _shadow[idx] = oldShadow[i];
+           _slots[idx].key.store(key, std::memory_order_relaxed);
+           markDirty(idx); //dirty and sticky bits do not survive the move, the collector looks at every slot once
+        }
+        release(old, oldShadow, oldDirty, oldSticky, oldCapacity);
+        ++_generation;
+     }
+
+     Slot* _slots;
+     C* _shadow;     //< collector side value of every slot
+     std::atomic<uint8_t>* _dirty;  //< byte per slot, set by the owner on update, cleared by the collector
+     uint64_t* _sticky;             //< bit per slot, collector only
+     uint64_t _mask;
+     uint32_t _shift;
+     uint64_t _seed;       //< hash seed, goes with the slots
+     std::atomic<uint64_t> _size; //< owner writes, the collector reads it to balance the aggregate workers
+     uint64_t _generation; //< bumped when the slots move (grow, move)
+     std::atomic<uint64_t> _bytes; //< memory(), written with the slot arrays
+     std::mutex _growMtx;
+};
+
+#endif /* _FLAT_STATS_TABLE_H */
@@ -0,0 +1,117 @@
+#include <atomic>
+#include <new>
+#include <stdlib.h>
+#include <stdint.h>
+#include "../SimdKernels.h"
+#ifndef _STATIC_STATS_H
+#define _STATIC_STATS_H
+
+/*
+ * Compile time registered stats.
+ * The includer defines STATIC_STATS_LIST(X) with one X(name, statId) per stat, e.g.
+ *
+ *   #define STATIC_STATS_LIST(X) \
+ *      X(RX_PACKETS, 1000) \
+ *      X(TX_PACKETS, 1001)
+ *   #include "StaticStats.h"
+ *
+ * Every declared stat gets a dense index (StaticStat::RX_PACKETS == 0, ...), so a thread
+ * keeps them in one contiguous array and an increment is a single indexed add, no hashing.
+ * The stat id is only used by the collector when merging with the dynamic (StatsMap) stats.
+ */
+#ifndef STATIC_STATS_LIST
+#error "define STATIC_STATS_LIST(X) before including StaticStats.h"
+#endif
+
+#define STATIC_STAT_ENUM(name, id) name,
+#define STATIC_STAT_ID(name, id) id,
+
+enum class StaticStat : uint32_t
+{
+   STATIC_STATS_LIST(STATIC_STAT_ENUM)
+   COUNT
+};
+
+static constexpr uint64_t STATIC_STAT_IDS[] = { STATIC_STATS_LIST(STATIC_STAT_ID) 0 };
+
+#undef STATIC_STAT_ENUM
+#undef STATIC_STAT_ID
+
+static constexpr uint32_t STATIC_STATS_COUNT = static_cast<uint32_t>(StaticStat::COUNT);
+
+/* compile time stat id of a registered stat */
+template <StaticStat S>
+struct StaticStatId
+{
+   static constexpr uint64_t value = STATIC_STAT_IDS[static_cast<uint32_t>(S)];
+};
+template <StaticStat S>
+constexpr uint64_t StaticStatId<S>::value;
+
+/* cache line aligned array of all the compile time registered counters of one thread */
+class StaticStatsBlock
+{
+  public:
+     static constexpr uint32_t CACHE_LINE = 64;
+     /* whole cache lines, so two threads blocks never share a line */
+     static constexpr uint32_t SLOTS = ((STATIC_STATS_COUNT + 7) / 8) * 8 + (STATIC_STATS_COUNT ? 0 : 8);
+
+     StaticStatsBlock()
+     {
+        for (uint32_t i = 0; i < SLOTS; ++i)
+        {
+           _values[i].store(0, std::memory_order_relaxed);
+           _lastSeen[i] = 0;
+        }
+     }
+     StaticStatsBlock(const StaticStatsBlock& other)
+     {
+        for (uint32_t i = 0; i < SLOTS; ++i)
+        {
+           _values[i].store(other.get(i), std::memory_order_relaxed);
+           _lastSeen[i] = other._lastSeen[i];
+        }
+     }
+     StaticStatsBlock& operator=(const StaticStatsBlock&) = delete;
+
+     /* heap instances must be cache line aligned, plain new does not honour alignas before c++17 */
+     static void* operator new(size_t size)
+     {
+        void* ptr = nullptr;
+        if (::posix_memalign(&ptr, CACHE_LINE, size) != 0) throw std::bad_alloc();
+        return ptr;
+     }
+     static void operator delete(void* ptr) { ::free(ptr); }
+
+     /* owner thread only, single writer so no locked instruction */
+     template <StaticStat S>
+     void inc(uint64_t val) { add(static_cast<uint32_t>(S), val); }
+     template <StaticStat S>
+     void dec(uint64_t val) { add(static_cast<uint32_t>(S), -val); }
+
+     uint64_t get(uint32_t idx) const { return _values[idx].load(std::memory_order_relaxed); }
+     /* collector only, change since the previous call */
+     uint64_t delta(uint32_t idx)
+     {
+        uint64_t value = get(idx);
+        uint64_t delta = value - _lastSeen[idx];
+        _lastSeen[idx] = value;
+        return delta;
+     }
+     /* collector only, delta() of every slot: a relaxed copy, then one vector pass on it, false if none changed */
+     bool deltas(uint64_t (&out)[SLOTS])
+     {
+        uint64_t current[SLOTS];
+        SimdKernels::load(current, _values, SLOTS);
+        return SimdKernels::delta(out, current, _lastSeen, SLOTS);
+     }
+     static uint64_t statId(uint32_t idx) { return STATIC_STAT_IDS[idx]; }
+
+  private:
+     void add(uint32_t idx, uint64_t val) { _values[idx].store(get(idx) + val, std::memory_order_relaxed); }
+
+     alignas(CACHE_LINE) std::atomic<uint64_t> _values[SLOTS];
+     alignas(CACHE_LINE) uint64_t _lastSeen[SLOTS]; //< collector side, own cache lines
+};
+
+#endif /* _STATIC_STATS_H */
@@ -88,5 +88,52 @@ private:
     ThreadStorage<void*, VoidDestructor> data_;
   };
 
+  /*
+   * ThreadLocalStorage - same interface as ThreadStorage, but data() reads a C++11 thread_local instead of
+   * calling pthread_getspecific, so the read inlines to a single thread pointer relative load.
+   * The value is also stored once per thread in a pthread key, so DestructorType still runs at thread exit.
+   * The thread_local is static, Tag tells apart two storages of the same T and U.
+   */
+  template <typename T, typename U = DefaultThreadStorageDestructor<T>, typename Tag = void>
+  class ThreadLocalStorage {
+  public:
+    typedef T   ValueType;
+    typedef U   DestructorType;
+
+    ThreadLocalStorage() {
+    }
+
+    virtual ~ThreadLocalStorage() {
+    }
+
+    ValueType data() const {
+      return value_;
+    }
+
+    void data(ValueType value) {
+      value_ = value;
+      this->key_.data(value);
+    }
+
+  private:
+    class ExitDestructor {
+    public:
+      void operator ()(ValueType value) {
+        value_ = ValueType();
+        DestructorType dtor;
+        dtor(value);
+      }
+    };
+
+    ThreadLocalStorage(const ThreadLocalStorage&);
+    ThreadLocalStorage& operator =(const ThreadLocalStorage&);
+
+    static thread_local ValueType value_;
+    ThreadStorage<ValueType, ExitDestructor> key_;
+  };
+
+  template <typename T, typename U, typename Tag>
+  thread_local T ThreadLocalStorage<T, U, Tag>::value_ = T();
+
 
 #endif /* _THREAD_STORAGE_H */
@@ -8,20 +8,48 @@
 #include <unordered_set>
 #include <unordered_map>
 #include <mutex>
+#include <condition_variable>
+#include <sstream>
 #include <map>
 #include <chrono>
 #include "ThreadStorage.h" 
+#include "FlatStatsTable.h"
+#include "AggregatePool.h"
+#include "../StatsExporter.h"
+#include "../StatsShm.h"
+#include "../StatsHistory.h"
+#include "../StatsCollector.h"
+#include <memory>
+#include <algorithm>
 #include <stdio.h>      /* printf */
 #include <stdarg.h>   
+#include <string.h>
 #include <sys/types.h>
 #include <sys/syscall.h>
 #include <unistd.h>
+#include <sched.h>
 
 /* define  LOCAL_ATOMIC to 1 if you want to test distributed local stats */
 //#define LOCAL_ATOMIC 1
 
+/* compile time registered stats X(name, statId), incremented with ThreadStatsMapContainer::s_increment<StaticStat::name>() */
+#define STATIC_STATS_LIST(X) \
+   X(BENCH_STAT_0, 1000000) \
+   X(BENCH_STAT_1, 1000001) \
+   X(BENCH_STAT_2, 1000002) \
+   X(BENCH_STAT_3, 1000003) \
+   X(BENCH_STAT_4, 1000004) \
+   X(BENCH_STAT_5, 1000005) \
+   X(BENCH_STAT_6, 1000006) \
+   X(BENCH_STAT_7, 1000007)
+#include "StaticStats.h"
+
+/* -DSTATS_QUIET: no trace lines (benchmarks keep stdout for their results) */
 void lprint(const char* format, ...)
 {
+#ifdef STATS_QUIET
+   return;
+#endif
 
    static  std::mutex _mtx;
     va_list argptr;
@@ -51,72 +79,164 @@ class Singleton: public NCA
 
 };
 
-struct State {
+struct StatKind {
   enum Type {
-    NONE = 0,     //< The stat hasn't been changed
-    UPDATED = 1,  //< The stat was either incremented or decremented
-    SET = 2       //< The stat was set
+    SUM = 0,     //< inc/dec, the threads values are added
+    GAUGE = 1,   //< set, the most recent set() of any thread wins (timestamped)
+    MAX = 2,     //< largest value set in the interval
+    MIN = 3,     //< smallest value set in the interval
+    RATE = 4     //< inc, reported as value per second of the interval
   };
 };
 
 /* all the stats counters must implement from StatCounter */
+/*
+ * A StatCounter has a single writer, the thread owning the StatsMap (or the collector for the aggregated map),
+ * so updates are a relaxed load + store, no locked instruction. The collector never resets SUM/RATE/GAUGE
+ * counters, it remembers the last value it has seen (collector side, see FlatStatsTable) and aggregates the delta.
+ * MAX/MIN are per interval, the collector takes them with an exchange once per interval. The owner only writes
+ * when its value is a new max / min, with a compare exchange: an update racing with the collector exchange fails
+ * the compare, sees the reset value and lands in the next interval, it is never lost and never overwrites the
+ * reset with a stale value.
+ * The kind of a counter is the kind of its last update, a stat id is expected to be used with one kind.
+ */
 class StatCounter
 {
   public:
+     static const uint64_t MIN_EMPTY = ~0ULL;
+
      StatCounter()
-      : _value(0), _state(State::Type::NONE)
+      : _value(0), _stamp(0), _kind(StatKind::SUM)
      {} 
      StatCounter( const StatCounter& counter)
       : _value(counter.getStatValue()),
-        _state(counter.getState())
+        _stamp(counter.getStamp()),
+        _kind(counter.getKind())
      {
      }
      StatCounter& operator=(const StatCounter& other)
      {
        if (this == &other) return *this; 
-       _value = other.getStatValue();
-        _state = other.getState();
+       _value.store(other.getStatValue(), std::memory_order_relaxed);
+       _stamp.store(other.getStamp(), std::memory_order_relaxed);
+       _kind.store(other.getKind(), std::memory_order_relaxed);
        return *this;
      }
-     StatCounter& operator+=(StatCounter& other)
+     /* merges two aggregated counters (collector side) */
+     StatCounter& operator+=(const StatCounter& other)
      {
        if (this != &other)
        {
           // lprint("%ld BEFORE += total statId: %ld, new: %ld\n",pthread_self(), getStatValue(), other.getStatValue());
-         _state = other.getState();
-         _value.fetch_add(other._value);
+         merge(other.getKind(), other.getStatValue(), other.getStamp());
          //lprint("%ld AFTRE += total statId: %ld\n",pthread_self(), getStatValue());
        }
        return *this;
      }
-     void copyAndReset(StatCounter& other)
+     /* collector side: fold what changed in other (a thread counter) since lastSeen into this counter */
+     void collect(StatCounter& other, uint64_t& lastSeen)
      {
-       if (this != &other)
+       if (this == &other) return;
+       StatKind::Type kind = other.getKind();
+       switch (kind)
        {
-         _state = other.getState();
-         _value =+ other.reset();
+         case StatKind::SUM:
+         case StatKind::RATE:
+         {
+           uint64_t value = other.getStatValue();
+           if (value != lastSeen || kind != getKind()) merge(kind, value - lastSeen, 0);
+           lastSeen = value;
+           break;
+         }
+         case StatKind::GAUGE:
+           merge(kind, other.getStatValue(), other.getStamp());
+           break;
+         case StatKind::MAX:
+         {
+           uint64_t value = other._value.exchange(0);
+           if (value) merge(kind, value, 0);
+           break;
+         }
+         case StatKind::MIN:
+         {
+           uint64_t value = other._value.exchange(MIN_EMPTY);
+           if (value != MIN_EMPTY) merge(kind, value, 0);
+           break;
+         }
        }
      }
-     void inc(uint64_t val) { _value+= val; _state =State::UPDATED; }
-     void dec(uint64_t val) { _value-= val ;_state =State::UPDATED; }
-     void set(uint64_t val) { _value = val ; _state =State::SET; }
-     //TODO, ASH we need to reset instead of just get value
-     uint64_t reset() { _state = State::NONE; return _value.exchange(0); }
-     //uint64_t reset() { _state = State::NONE; return getStatValue(); }
+     /* owner side updates */
+     /* SUM is the default kind, the hot inc/dec path does not touch _kind */
+     void inc(uint64_t val) { store(getStatValue() + val); }
+     void dec(uint64_t val) { store(getStatValue() - val); }
+     void rate(uint64_t val) { store(getStatValue() + val); setKind(StatKind::RATE); }
+     void set(uint64_t val) 
+     {
+       store(val);
+       _stamp.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+       setKind(StatKind::GAUGE);
+     }
+     void max(uint64_t val)
+     {
+       if (getKind() != StatKind::MAX) { store(val); setKind(StatKind::MAX); return; }
+       uint64_t current = getStatValue();
+       while (val > current && !_value.compare_exchange_weak(current, val, std::memory_order_relaxed)) {}
+     }
+     void min(uint64_t val)
+     {
+       if (getKind() != StatKind::MIN) { store(val); setKind(StatKind::MIN); return; }
+       uint64_t current = getStatValue();
+       while (val < current && !_value.compare_exchange_weak(current, val, std::memory_order_relaxed)) {}
+     }
      uint64_t getStatValue() const  { return _value.load(std::memory_order_relaxed); }
-     State::Type getState() const { return _state; }
+     uint64_t getStamp() const  { return _stamp.load(std::memory_order_relaxed); }
+     StatKind::Type getKind() const { return _kind.load(std::memory_order_relaxed); }
    protected:
+     void store(uint64_t val) { _value.store(val, std::memory_order_relaxed); }
+     void setKind(StatKind::Type kind) { if (getKind() != kind) _kind.store(kind, std::memory_order_relaxed); }
+     /* merge semantic of each kind */
+     void merge(StatKind::Type kind, uint64_t val, uint64_t stamp)
+     {
+       bool first = getKind() != kind;
+       switch (kind)
+       {
+         case StatKind::SUM:
+         case StatKind::RATE:
+           store(first ? val : getStatValue() + val);
+           break;
+         case StatKind::GAUGE:
+           if (first || stamp >= getStamp())
+           {
+             store(val);
+             _stamp.store(stamp, std::memory_order_relaxed);
+           }
+           break;
+         case StatKind::MAX:
+           if (first || val > getStatValue()) store(val);
+           break;
+         case StatKind::MIN:
+           if (first || val < getStatValue()) store(val);
+           break;
+       }
+       setKind(kind);
+     }
      std::atomic<uint64_t> _value;
-     State::Type _state;
+     std::atomic<uint64_t> _stamp;   //< GAUGE: steady clock time of the last set
+     std::atomic<StatKind::Type> _kind;
 };
+const uint64_t StatCounter::MIN_EMPTY;
+
+/* per thread stats are kept in a flat open addressing table, see FlatStatsTable.h */
+typedef FlatStatsTable<StatCounter> StatsTable;
 
 /* StatsMap is a singleton globals  stats structure used by collector to collect and local variables to register */
 class StatsMap
 {
      
     public:
-     StatsMap() : _usable(true) 
+     StatsMap() : _usable(true), _static(new StaticStatsBlock()), _intervalSec(0) 
      {
+        memset(_staticSums, 0, sizeof(_staticSums));
         //lprint("%ld:%p Ctr called\n", pthread_self(), this);
      }
      ~StatsMap() 
@@ -126,13 +246,20 @@ class StatsMap
      StatsMap(const StatsMap& other) 
       : _usable(other.isUsable())
       , _statsIds(other.getStatsMap())
+      , _static(new StaticStatsBlock(other.getStaticStats()))
+      , _intervalSec(other.getInterval())
      {  
+        memcpy(_staticSums, other._staticSums, sizeof(_staticSums));
         //lprint("%ld:%p CopyCtr called\n", pthread_self(), this);
      }
      StatsMap(StatsMap&& other) 
       : _usable(other.isUsable())
       , _statsIds(std::move(other.getStatsMap()))
-     {  
+      , _static(new StaticStatsBlock())
+      , _intervalSec(other.getInterval())
+     {
+        _static.swap(other._static);  
+        memcpy(_staticSums, other._staticSums, sizeof(_staticSums));
         //lprint("%ld:%p MoveCtr called\n", pthread_self(), this);
      }
      StatsMap& operator=(StatsMap&& other) noexcept 
@@ -141,179 +268,620 @@ class StatsMap
         if (this != &other)
         {
           this->_statsIds = std::move(other.getStatsMap());
-          this->_usable = other.isUsable();
+          this->_static.swap(other._static);
+          this->_usable.store(other.isUsable(), std::memory_order_relaxed);
+          this->_intervalSec = other.getInterval();
+          memcpy(this->_staticSums, other._staticSums, sizeof(_staticSums));
         }
         return *this;
      }
      StatsMap& operator+=(StatsMap& stats)
      {
         uint64_t totalStats = 0;
-        for(auto& stat: stats.getStatsMap())
+        SimdKernels::add(_staticSums, stats._staticSums, StaticStatsBlock::SLOTS);
+        stats.getStatsMap().forEach([&](uint64_t key, StatCounter& stat)
         {
-           StatCounter& current = getStats(stat.first);
-           //lprint("%ld BEFORE += total statId: %ld, new: %ld\n",pthread_self(), current.getStatValue(), stat.second.getStatValue());
-           current += stat.second;
+           StatCounter& current = getStats(key);
+           //lprint("%ld BEFORE += total statId: %ld, new: %ld\n",pthread_self(), current.getStatValue(), stat.getStatValue());
+           current += stat;
            //lprint("%ld AFTER += total statId: %ld, \n",pthread_self(), current.getStatValue());
            totalStats += current.getStatValue();
-        }
+        });
         //lprint("%ld OP += total statId: %d, Total value: %ld \n",pthread_self(), _statsIds.size(), totalStats;
         return *this;
      } 
-     void copyAndResetStats(StatsMap& stats)
+     /*
+      * collects what changed in stats since the previous call, the source counters are only read.
+      * merges both kinds, the compile time stats deltas are added to the dense _staticSums in one vector pass,
+      * foldStatic() moves them into the dynamic table under their stat id once the last map is collected
+      */
+     void collectStats(StatsMap& stats)
      {
         uint64_t totalStats = 0;
-        for(auto& stat: stats.getStatsMap())
+        uint64_t deltas[StaticStatsBlock::SLOTS];
+        if (stats.getStaticStats().deltas(deltas)) SimdKernels::add(_staticSums, deltas, StaticStatsBlock::SLOTS);
+        /* only the counters updated since the previous pass, gauges are kept sticky so every interval reports them */
+        stats.getStatsMap().forEachDirty([&](uint64_t key, StatCounter& stat, uint64_t& lastSeen)
         {
-           StatCounter& current = getStats(stat.first);
-           current.copyAndReset(stat.second);
-           //current += stat.second;
+           StatCounter& current = getStats(key);
+           current.collect(stat, lastSeen);
            totalStats += current.getStatValue();
-        }
+           return StatKind::GAUGE == stat.getKind();
+        });
         //lprint("%ld OP += total statId: %d, Total value: %ld \n",pthread_self(), _statsIds.size(), totalStats);
      }
+     /* aggregated maps: the summed compile time stats into the dynamic table, once per aggregate() */
+     void foldStatic()
+     {
+        for(uint32_t idx = 0; idx < STATIC_STATS_COUNT; ++idx)
+        {
+           if (0 == _staticSums[idx]) continue;
+           getStats(StaticStatsBlock::statId(idx)).inc(_staticSums[idx]);
+           _staticSums[idx] = 0;
+        }
+     }
      void print()
      {
         uint64_t totalStats = 0;
-        for(auto& stat: _statsIds)
+        _statsIds.forEach([&](uint64_t, StatCounter& stat)
         {
-           uint64_t value = stat.second.getStatValue();
+           uint64_t value = stat.getStatValue();
            totalStats += value;
-           //std::cout<<"statId: "<<stat.first<< "value: "<< value<<std::endl;
-           
-        }
+           //std::cout<<"statId: "<<key<< "value: "<< value<<std::endl;
+        });
         lprint("%ld STATS MAP: total statId: %d, Total value: %ld \n",pthread_self(), _statsIds.size(), totalStats);
      }
-     void set(uint64_t key, uint64_t val = 0) { StatCounter& stat = getStats(key); stat.set(val);} 
-     void inc(uint64_t key, uint64_t val = 1) { StatCounter& stat = getStats(key); stat.inc(val );}
-     void dec(uint64_t key, uint64_t val = -1) { StatCounter& stat = getStats(key); stat.dec(val );}
+     /* owner updates mark the slot dirty, the collector only visits what changed (FlatStatsTable::forEachDirty) */
+     void set(uint64_t key, uint64_t val = 0) { _statsIds.update(key, [val](StatCounter& stat) { stat.set(val); }); } 
+     void inc(uint64_t key, uint64_t val = 1) { _statsIds.update(key, [val](StatCounter& stat) { stat.inc(val); }); }
+     void dec(uint64_t key, uint64_t val = -1) { _statsIds.update(key, [val](StatCounter& stat) { stat.dec(val); }); }
+     void max(uint64_t key, uint64_t val) { _statsIds.update(key, [val](StatCounter& stat) { stat.max(val); }); }
+     void min(uint64_t key, uint64_t val) { _statsIds.update(key, [val](StatCounter& stat) { stat.min(val); }); }
+     void rate(uint64_t key, uint64_t val = 1) { _statsIds.update(key, [val](StatCounter& stat) { stat.rate(val); }); }
+     /* bulk increment keys[i] by vals[i], the thread map is resolved once by the caller */
+     void incMany(const uint64_t* keys, const uint64_t* vals, size_t n)
+     {
+        for (size_t i = 0; i < n; ++i) inc(keys[i], vals[i]);
+     }
+     /* aggregated maps: length of the collected interval and RATE stats per second over it */
+     void setInterval(double seconds) { _intervalSec = seconds; }
+     double getInterval() const { return _intervalSec; }
+     double getRate(uint64_t key) { return _intervalSec > 0 ? getStats(key).getStatValue() / _intervalSec : 0; }
      StatCounter& getStats(uint64_t key) { return _statsIds[key];};
-     bool isUsable() const { return _usable; }
-     void setUnusable() { _usable = false; }
-     std::map<uint64_t, StatCounter>& getStatsMap() { return _statsIds;}
-     const std::map<uint64_t, StatCounter>& getStatsMap() const { return _statsIds;}
+     template <StaticStat S>
+     void s_inc(uint64_t val = 1) { _static->inc<S>(val); }
+     template <StaticStat S>
+     void s_dec(uint64_t val = 1) { _static->dec<S>(val); }
+     /* release/acquire: once the collector sees a map unusable it also sees the owner's last updates */
+     bool isUsable() const { return _usable.load(std::memory_order_acquire); }
+     void setUnusable() { _usable.store(false, std::memory_order_release); }
+     StatsTable& getStatsMap() { return _statsIds;}
+     const StatsTable& getStatsMap() const { return _statsIds;}
+     StaticStatsBlock& getStaticStats() { return *_static;}
+     const StaticStatsBlock& getStaticStats() const { return *_static;}
     protected:
-      bool _usable;
-      std::map<uint64_t, StatCounter> _statsIds;
+      std::atomic<bool> _usable;
+      StatsTable _statsIds;
+      std::unique_ptr<StaticStatsBlock> _static; //< dense array of the compile time registered stats
+      double _intervalSec;
+      uint64_t _staticSums[StaticStatsBlock::SLOTS]; //< aggregated maps: collected static deltas, see foldStatic()
       
 };
 
 
 /* ThreadStatsMapContainer is a singleton globals  stats structure used by collector to collect and local variables to register */
+/*
+ * Per thread maps are linked in a lock free intrusive list, a new thread pushes its node at the head with a CAS
+ * and never waits for the collector. Only the collector (aggregate() / drainExited(), serialized by _collectMtx)
+ * unlinks nodes, and always the nodes of exited threads: the thread exit (ThreadDestructor) pushes the node on the
+ * exited stack, a lock free MPSC intrusive stack (one CAS, the link is in the node, no allocation), the collector
+ * takes the whole stack with one exchange. The list is only walked by the collector under _collectMtx, after the
+ * exited nodes are collected, so an unlinked node is freed right away.
+ */
 class ThreadStatsMapContainer : public Singleton
 {
    public:
+      /* StatsMap of one thread, linked in the container list */
+      struct ThreadStatsNode : public StatsMap
+      {
+         ThreadStatsNode() : _next(nullptr), _exitedNext(nullptr), _exited(false), _cpu(-1), _keysSeen(0) {}
+         std::atomic<ThreadStatsNode*> _next;
+         ThreadStatsNode* _exitedNext;  //< exited stack, written by the exiting thread before its push
+         bool _exited;                  //< taken from the exited stack, collector only
+         int _cpu; //< cpu the thread was created on, numa grouping of the parallel aggregate()
+         uint64_t _keysSeen; //< keys of the map at the previous collection, self stats, collector only
+      };
+
+      ~ThreadStatsMapContainer()
+      {
+        ThreadStatsNode* node = _head.load(std::memory_order_acquire);
+        while(node)
+        {
+           ThreadStatsNode* next = node->_next.load(std::memory_order_relaxed);
+           delete node;
+           node = next;
+        }
+      }
+
       __attribute__((noinline)) StatsMap aggregate()
       {
         //std::cout<<pthread_self()<<" enetring aggregatep"<<std::endl;
+        auto begin = std::chrono::steady_clock::now();
         StatsMap statsAggr;
         //lprint("%ld:%p Created Aggr Stats Map\n",pthread_self(), &statsAggr);
-        std::lock_guard<std::mutex> lck (_mtx);
-        auto it = _statsMap.begin();
-        auto end = _statsMap.end();
-        while(it != end)  
+        uint64_t waitNs = lockTimed(_collectMtx);
+        std::lock_guard<std::mutex> lck (_collectMtx, std::adopt_lock);
+        _collectWaitNs += waitNs;
+        uint64_t maps = 0, bytes = 0;
+        /* before collecting, the final values of the taken maps are visible after the exchange */
+        takeExited();
+        _nodes.clear();
+        ThreadStatsNode* node = _head.load(std::memory_order_acquire);
+        while(node)
         {
-           statsAggr.copyAndResetStats(it->second);
-           if(!it->second.isUsable())
+           _nodes.push_back(node);
+           countKeys(*node);
+           if(!node->_exited)
            {
-             //lprint("%ld:%p Aggr deleting stats map\n",pthread_self(), &(it->second));
-              _statsMap.erase(it++);
+             ++maps;
+             bytes += node->getStatsMap().memory() + sizeof(ThreadStatsNode) + sizeof(StaticStatsBlock);
            }
-           else
-           {
-             ++it;
-           }   
-            
+           node = node->_next.load(std::memory_order_acquire);
+        }
+
+        if(_pool && _nodes.size() >= PARALLEL_MIN_MAPS)
+        {
+           collectParallel(statsAggr);
+        }
+        else
+        {
+           for(auto node : _nodes) statsAggr.collectStats(*node);
+        }
+
+        unlinkExited();
+        if(_exitedCollected)
+        {
+          statsAggr += _exitedStats; //maps of the threads drainExited() already freed
+          _exitedStats = StatsMap();
+          _exitedCollected = false;
         }
+        statsAggr.foldStatic();
+        auto now = std::chrono::steady_clock::now();
+        statsAggr.setInterval(std::chrono::duration<double>(now - _lastAggregate).count());
+        if(!_exporters.empty()) exportStats(statsAggr, now);
+        _lastAggregate = now;
+        if(_selfStats) recordSelfStats(begin, waitNs, maps, bytes);
         lprint("%ld returning from aggr, size: %d \n",pthread_self(), statsAggr.getStatsMap().size());
-        return std::move(statsAggr);
+        return statsAggr;
      }
       
+      /*
+       * collector side, between two aggregate(): collects the maps of the threads that exited since the previous
+       * call or aggregate() and frees them, their values are reported by the next aggregate(). Only walks the list
+       * when a thread exited, so a high rate of short lived threads does not pile up maps between intervals.
+       */
+      void drainExited()
+      {
+        uint64_t waitNs = lockTimed(_collectMtx);
+        std::lock_guard<std::mutex> lck (_collectMtx, std::adopt_lock);
+        _collectWaitNs += waitNs;
+        if(nullptr == _exitedHead.load(std::memory_order_relaxed)) return;
+        takeExited();
+        for(auto node : _exitedNodes)
+        {
+          countKeys(*node);
+          _exitedStats.collectStats(*node);
+        }
+        _exitedCollected = _exitedCollected || !_exitedNodes.empty();
+        unlinkExited();
+      }
+      /*
+       * aggregate() merges the thread maps on workers threads (AggregatePool.h), 0 merges them on the calling
+       * thread. numa: the workers are pinned per numa node and merge the maps of the threads of their node.
+       */
+      void setAggregateWorkers(uint32_t workers, bool numa = false)
+      {
+        std::lock_guard<std::mutex> lck (_collectMtx);
+        _pool.reset(workers ? new AggregatePool(workers, numa) : nullptr);
+      }
+      /*
+       * self instrumentation: after every aggregate() the calling thread records what the library cost under the
+       * SELF_*_STAT_ID ids (../StatsCollector.h) with i_set / i_increment / i_rate, so they are aggregated and
+       * exported with the next interval: aggregate() duration, lock waits (collector on _collectMtx, owners and
+       * collector on the table grow locks), lock hold, live thread maps, bytes per map, table allocations and
+       * keys created in the thread maps (rate). Off by default, a few updates per pass when on.
+       */
+      void enableSelfStats(bool enable = true)
+      {
+        std::lock_guard<std::mutex> lck (_collectMtx);
+        _selfStats = enable;
+        _allocationsSeen = StatsTable::allocations();
+        _lockWaitSeen = StatsTable::lockWaitNs();
+        _collectWaitNs = 0;
+        _newKeys = 0;
+      }
+      /* called by aggregate() with the stats of every interval, not owned, must outlive the container */
+      void addExporter(StatsExporter* exporter)
+      {
+        std::lock_guard<std::mutex> lck (_collectMtx);
+        _exporters.push_back(exporter);
+      }
+
       __attribute__((noinline)) StatsMap* createStats()
       {
         lprint("%ld in create statsmap\n" ,pthread_self());
-        std::lock_guard<std::mutex> lck (_mtx);
-        StatsMap& stat = _statsMap[pthread_self()];
-        //lprint("%ld:%p Created statsMap\n",pthread_self(), &stat);
-        //std::cout<<pthread_self()<<": Created new StatsMap size: "<<_statsMap.size()<<std::endl;
-        return &stat; 
+        ThreadStatsNode* node = new ThreadStatsNode();
+        node->_cpu = sched_getcpu(); //called by the owner thread
+        ThreadStatsNode* head = _head.load(std::memory_order_relaxed);
+        do
+        {
+          node->_next.store(head, std::memory_order_relaxed);
+        } while(!_head.compare_exchange_weak(head, node, std::memory_order_release, std::memory_order_relaxed));
+        //lprint("%ld:%p Created statsMap\n",pthread_self(), node);
+        return node; 
       }
       static ThreadStatsMapContainer& getInstance()
       {
             static ThreadStatsMapContainer instance;
             return instance;
       }
+    /* hot path of every update, inlined: one thread_local load (see StatsTLS) */
     static StatsMap& getStatsCtxt()
     {
         StatsMap* statsCntr  = _statsTLS.data();
-        if(nullptr == statsCntr)
+        if(__builtin_expect(nullptr == statsCntr, 0))
         {
-            lprint("%ld createing a new TLS \n" ,pthread_self());
-            statsCntr =  getInstance().createStats();
-            _statsTLS.data(statsCntr);
+            statsCntr = createStatsCtxt();
         }
         return *statsCntr;
     }
+    static __attribute__((noinline)) StatsMap* createStatsCtxt()
+    {
+        lprint("%ld createing a new TLS \n" ,pthread_self());
+        StatsMap* statsCntr =  getInstance().createStats();
+        _statsTLS.data(statsCntr);
+        return statsCntr;
+    }
     static void i_set(uint64_t key, uint64_t val) {getStatsCtxt().set(key,val) ;};
     static void i_increment(uint64_t key, uint64_t val){getStatsCtxt().inc(key,val); };
     static void i_decrement(uint64_t key, uint64_t val) {getStatsCtxt().dec(key,val); };
+    static void i_max(uint64_t key, uint64_t val) {getStatsCtxt().max(key,val); };
+    static void i_min(uint64_t key, uint64_t val) {getStatsCtxt().min(key,val); };
+    static void i_rate(uint64_t key, uint64_t val) {getStatsCtxt().rate(key,val); };
+    static void i_increment_many(const uint64_t* keys, const uint64_t* vals, size_t n) {getStatsCtxt().incMany(keys, vals, n); };
+    /* compile time registered stats, no lookup */
+    template <StaticStat S>
+    static void s_increment(uint64_t val) {getStatsCtxt().s_inc<S>(val); };
+    template <StaticStat S>
+    static void s_decrement(uint64_t val) {getStatsCtxt().s_dec<S>(val); };
 
 
 
       struct ThreadDestructor
       {
       public:
+          /* the thread last updates happen before the push, the collector exchange acquires them */
           void operator ()(StatsMap* value) {
               //lprint("%ld IN ThreadDestructor \n" ,pthread_self());
               value->setUnusable();
+              getInstance().pushExited(static_cast<ThreadStatsNode*>(value));
           }
       };
     protected:
-      std::unordered_map<pthread_t, StatsMap> _statsMap;
-      std::mutex _mtx;
-      static ThreadStorage<StatsMap*, ThreadDestructor>  _statsTLS;
+      static const uint32_t PARALLEL_MIN_MAPS = 8; //< fewer thread maps are merged on the calling thread
+
+      ThreadStatsMapContainer()
+       : _head(nullptr), _exitedHead(nullptr), _lastAggregate(std::chrono::steady_clock::now())
+       , _exitedCollected(false), _selfStats(false), _newKeys(0), _collectWaitNs(0), _allocationsSeen(0), _lockWaitSeen(0)
+      {}
+
+      /* under _collectMtx: thread maps only grow, the keys created since the previous collection of the map */
+      void countKeys(ThreadStatsNode& node)
+      {
+        uint64_t keys = node.getStatsMap().size();
+        _newKeys += keys - node._keysSeen;
+        node._keysSeen = keys;
+      }
+      /* under _collectMtx, see enableSelfStats() */
+      void recordSelfStats(std::chrono::steady_clock::time_point begin, uint64_t waitNs, uint64_t maps, uint64_t bytes)
+      {
+        uint64_t collectNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+        uint64_t allocations = StatsTable::allocations();
+        uint64_t lockWait = StatsTable::lockWaitNs();
+        i_set(SELF_COLLECT_NS_STAT_ID, collectNs);
+        i_increment(SELF_LOCK_WAIT_NS_STAT_ID, _collectWaitNs + lockWait - _lockWaitSeen);
+        i_increment(SELF_LOCK_HOLD_NS_STAT_ID, collectNs - waitNs);
+        i_set(SELF_MAPS_STAT_ID, maps);
+        i_set(SELF_BYTES_STAT_ID, maps ? bytes / maps : 0);
+        i_increment(SELF_ALLOCATIONS_STAT_ID, allocations - _allocationsSeen);
+        i_rate(SELF_NEW_KEYS_STAT_ID, _newKeys);
+        _allocationsSeen = allocations;
+        _lockWaitSeen = lockWait;
+        _collectWaitNs = 0;
+        _newKeys = 0;
+      }
+      /* pushers only ever change _head, so an interior node is unlinked with a plain store */
+      void unlink(ThreadStatsNode* prev, ThreadStatsNode* node, ThreadStatsNode* next)
+      {
+        if(nullptr == prev)
+        {
+          ThreadStatsNode* expected = node;
+          if(_head.compare_exchange_strong(expected, next, std::memory_order_acq_rel)) return;
+          /* new threads were pushed in front of node, it is interior now */
+          prev = expected;
+          while(prev->_next.load(std::memory_order_acquire) != node)
+            prev = prev->_next.load(std::memory_order_acquire);
+        }
+        prev->_next.store(next, std::memory_order_release);
+      }
+      /* exiting thread, lock free, no allocation */
+      void pushExited(ThreadStatsNode* node)
+      {
+        ThreadStatsNode* head = _exitedHead.load(std::memory_order_relaxed);
+        do
+        {
+          node->_exitedNext = head;
+        } while(!_exitedHead.compare_exchange_weak(head, node, std::memory_order_release, std::memory_order_relaxed));
+      }
+      /* under _collectMtx: takes the whole exited stack, marks its nodes for unlinkExited() */
+      void takeExited()
+      {
+        _exitedNodes.clear();
+        for(ThreadStatsNode* node = _exitedHead.exchange(nullptr, std::memory_order_acquire); node; node = node->_exitedNext)
+        {
+          node->_exited = true;
+          _exitedNodes.push_back(node);
+        }
+      }
+      /* under _collectMtx, once the taken nodes are collected: one walk, unlinks and frees them */
+      void unlinkExited()
+      {
+        size_t left = _exitedNodes.size();
+        ThreadStatsNode* prev = nullptr;
+        for(ThreadStatsNode* node = _head.load(std::memory_order_acquire); node && left; )
+        {
+          ThreadStatsNode* next = node->_next.load(std::memory_order_acquire);
+          if(node->_exited)
+          {
+            //lprint("%ld:%p Aggr deleting stats map\n",pthread_self(), node);
+            unlink(prev, node, next);
+            delete node;
+            --left;
+          }
+          else
+          {
+            prev = node;
+          }
+          node = next;
+        }
+      }
+      /*
+       * under _collectMtx: every worker merges its group of thread maps into its own partial map, then the
+       * partials are reduced pairwise (stride 1, 2, 4 ..), log2(workers) rounds, the result lands in partial 0
+       */
+      void collectParallel(StatsMap& statsAggr)
+      {
+        uint32_t workers = _pool->workers();
+        std::vector<StatsMap> partials(workers);
+        groupNodes(workers);
+        _pool->run(workers, [&](uint32_t task)
+        {
+          for(auto node : _groups[task]) partials[task].collectStats(*node);
+        });
+        for(uint32_t stride = 1; stride < workers; stride *= 2)
+        {
+          _pool->run(workers, [&](uint32_t task)
+          {
+            if(0 == task % (2 * stride) && task + stride < workers) partials[task] += partials[task + stride];
+          });
+        }
+        statsAggr = std::move(partials[0]);
+      }
+      /* each thread map goes to the least loaded worker (in slots), of its thread numa node with a numa pool */
+      void groupNodes(uint32_t workers)
+      {
+        _groups.resize(workers);
+        for(auto& group : _groups) group.clear();
+        _load.assign(workers, 0);
+        for(auto node : _nodes)
+        {
+          uint32_t numaNode = _pool->topology().nodeOfCpu(node->_cpu);
+          uint32_t best = workers;
+          for(uint32_t w = 0; w < workers; ++w)
+          {
+            if(_pool->numa() && _pool->workerNode(w) != numaNode) continue;
+            if(best == workers || _load[w] < _load[best]) best = w;
+          }
+          if(best == workers) //no worker on that node
+          {
+            best = std::min_element(_load.begin(), _load.end()) - _load.begin();
+          }
+          _groups[best].push_back(node);
+          _load[best] += node->getStatsMap().size() + 1;
+        }
+      }
+      /* under _collectMtx */
+      void exportStats(StatsMap& statsAggr, std::chrono::steady_clock::time_point now)
+      {
+        uint64_t timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+        uint64_t interval = std::chrono::duration_cast<std::chrono::nanoseconds>(now - _lastAggregate).count();
+        _exportRecords.clear();
+        statsAggr.getStatsMap().forEach([this](uint64_t key, StatCounter& stat)
+        {
+          ExportRecord record = { key, 0, static_cast<uint8_t>(stat.getKind()), stat.getStatValue() };
+          _exportRecords.push_back(record);
+        });
+        for(auto exporter : _exporters)
+          exporter->exportStats(timestamp, interval, _exportRecords.data(), _exportRecords.size());
+      }
+
+      std::atomic<ThreadStatsNode*> _head;
+      std::atomic<ThreadStatsNode*> _exitedHead; //< nodes of exited threads, pushed at thread exit
+      std::mutex _collectMtx;             //< serializes collectors, never taken by worker threads
+      std::chrono::steady_clock::time_point _lastAggregate; //< start of the interval the next aggregate() collects
+      std::vector<StatsExporter*> _exporters;   //< under _collectMtx
+      std::vector<ExportRecord> _exportRecords; //< reused every interval
+      std::unique_ptr<AggregatePool> _pool;     //< under _collectMtx, nullptr: serial aggregate()
+      std::vector<ThreadStatsNode*> _nodes;     //< thread maps of the current aggregate(), list order
+      std::vector<ThreadStatsNode*> _exitedNodes; //< taken from the exited stack, under _collectMtx
+      StatsMap _exitedStats;                    //< collected by drainExited(), reported by the next aggregate()
+      bool _exitedCollected;
+      std::vector<std::vector<ThreadStatsNode*> > _groups; //< thread maps of each pool worker
+      std::vector<uint64_t> _load;              //< slots assigned to each pool worker
+      bool _selfStats;                          //< self instrumentation, the members below are under _collectMtx
+      uint64_t _newKeys;                        //< keys created in the thread maps since the previous aggregate()
+      uint64_t _collectWaitNs;                  //< waits on _collectMtx since the previous aggregate()
+      uint64_t _allocationsSeen;                //< StatsTable::allocations() at the previous aggregate()
+      uint64_t _lockWaitSeen;                   //< StatsTable::lockWaitNs() at the previous aggregate()
+#ifdef PTHREAD_SPECIFIC_TLS
+      typedef ThreadStorage<StatsMap*, ThreadDestructor> StatsTLS;      //< pthread_getspecific on every update
+#else
+      typedef ThreadLocalStorage<StatsMap*, ThreadDestructor> StatsTLS; //< thread_local, destructor through a pthread key
+#endif
+      static StatsTLS  _statsTLS;
 };
 
-ThreadStorage<StatsMap*, ThreadStatsMapContainer::ThreadDestructor> ThreadStatsMapContainer::_statsTLS;
+ThreadStatsMapContainer::StatsTLS ThreadStatsMapContainer::_statsTLS;
+
+/*
+ * StatBatch - batched updates of one SUM key for tight loops. The thread StatsMap and the key slot are resolved
+ * once, updates go to a local and are flushed into the slot at scope exit or every flushEvery updates, so the
+ * collector keeps seeing progress of long loops.
+ *    StatBatch rxPackets(RX_PACKETS_KEY);
+ *    for (auto& pkt : burst) rxPackets.inc();
+ */
+class StatBatch : public NCA
+{
+  public:
+     explicit StatBatch(uint64_t key, uint32_t flushEvery = 4096)
+      : _stats(ThreadStatsMapContainer::getStatsCtxt())
+      , _key(key)
+      , _counter(&_stats.getStats(key))
+      , _generation(_stats.getStatsMap().generation())
+      , _pending(0)
+      , _updates(0)
+      , _flushEvery(flushEvery)
+     {}
+     ~StatBatch() { flush(); }
+     void inc(uint64_t val = 1)
+     {
+        _pending += val;
+        if (++_updates >= _flushEvery) flush();
+     }
+     void flush()
+     {
+        if (0 == _updates) return;
+        if (_generation != _stats.getStatsMap().generation())
+        {
+           /* the table grew since the slot was resolved */
+           _counter = &_stats.getStats(_key);
+           _generation = _stats.getStatsMap().generation();
+        }
+        _counter->inc(_pending);
+        _stats.getStatsMap().markDirty(*_counter);
+        _pending = 0;
+        _updates = 0;
+     }
+  private:
+     StatsMap& _stats;
+     uint64_t _key;
+     StatCounter* _counter;
+     uint64_t _generation;
+     uint64_t _pending;
+     uint32_t _updates;
+     uint32_t _flushEvery;
+};
 
 
-//TEST code starts here
+//TEST code starts here, -DSTATS_NO_MAIN builds only the stats classes (Test/bench_*.cpp include this file)
+#ifndef STATS_NO_MAIN
 //testing
 /*
  * all thread waits until it is ready object. stats are incremented once this value is set to true.  
  * collector signals thread to stop incrementing counter by sresetting ready value;
  */   
-bool ready = false;
-//dumpCollectedStats - collector starts dumping aggregated stats to console 
-bool dumpCollectedStats = false;
+std::atomic<bool> ready(false);
+//raceStarted / workersDone - the collector blocks on them, starts collecting and dumps the aggregated stats
+StatsEvent raceStarted;
+StatsEvent workersDone;
+
+/* number of 1 second collection cycles */
+#ifndef COLLECT_CYCLES
+#define COLLECT_CYCLES 15
+#endif
+
+/* sum of the aggregated worker stats after the final pass, main() checks it against globalCount */
+uint64_t collectedCount = 0;
 
 //collectstats - start collecting stats and print aggregated values
 void collectstats() 
 {
    StatsMap aggr;
    lprint("%ld:%p Collect Stats\n",pthread_self(), &aggr);
-   uint32_t maxcount = 15;
-   while(!ready) {}
-   while(maxcount--)
+   StatsHistory history(300, StatsHistory::DELTAS); //5 minutes of intervals
+   ThreadStatsMapContainer::getInstance().addExporter(&history);
+#ifdef EXPORT_FILE
+   FileExporter exporter(EXPORT_FILE);
+   ThreadStatsMapContainer::getInstance().addExporter(&exporter);
+#endif
+#ifdef SHM_PATH
+   ShmExporter shm(SHM_PATH, 100000);
+   ThreadStatsMapContainer::getInstance().addExporter(&shm);
+#endif
+   uint32_t cycles = 0;
+   StatsMap last; //< latest interval
+   ThreadStatsMapContainer::getInstance().enableSelfStats();
+   StatsCollector collector([&aggr, &last]()
    {
-     /* fetch stats every 1 second */
-     //usleep(2);
-     //std::cout << syscall(SYS_gettid)<<" starting Agrregate \n";
-     auto start = std::chrono::high_resolution_clock::now();
      StatsMap stats = ThreadStatsMapContainer::getInstance().aggregate();
-     auto end = std::chrono::high_resolution_clock::now();
-     std::chrono::duration<double, std::milli> elapsed = end-start;
-     std::cout << syscall(SYS_gettid)<<" Agrregate time " << elapsed.count() << " ms\n";
      aggr+= stats;
-     std::this_thread::sleep_for(std::chrono::seconds(1));
-     //aggr.print(); 
-   }
-   ready = false;
-   //std::cout << "Enering Final collection \n";
-   while(!dumpCollectedStats) {} //wait for all threads to finish
-   StatsMap stats = ThreadStatsMapContainer::getInstance().aggregate();
-   aggr+= stats;
+     last = std::move(stats);
+   });
+   /* the pass duration is a stat of the collector thread, aggregated by the next pass */
+   collector.onPassDone([](uint64_t passNs) { ThreadStatsMapContainer::i_set(COLLECTOR_PASS_STAT_ID, passNs); });
+   /* every second, stops the race after COLLECT_CYCLES */
+   collector.subscribe(std::chrono::seconds(1), [&](bool final)
+   {
+     if (final) return;
+     const HistogramData& passes = collector.passHistogram();
+     std::cout << syscall(SYS_gettid)<<" Agrregate time " << aggr.getStats(COLLECTOR_PASS_STAT_ID).getStatValue() / 1e6
+               << " ms (p50 " << passes.percentile(0.5) / 1e6 << " p99 " << passes.percentile(0.99) / 1e6 << " max "
+               << collector.maxPassNs() / 1e6 << " ms over " << passes.count() << " passes)\n";
+     /* the library about itself, recorded after the previous pass */
+     std::cout << "   self: " << last.getStats(SELF_MAPS_STAT_ID).getStatValue() << " thread maps, "
+               << last.getStats(SELF_BYTES_STAT_ID).getStatValue() << " bytes/map, lock wait "
+               << last.getStats(SELF_LOCK_WAIT_NS_STAT_ID).getStatValue() / 1e3 << " us, lock hold "
+               << last.getStats(SELF_LOCK_HOLD_NS_STAT_ID).getStatValue() / 1e6 << " ms, "
+               << last.getStats(SELF_ALLOCATIONS_STAT_ID).getStatValue() << " allocations, "
+               << last.getRate(SELF_NEW_KEYS_STAT_ID) << " new keys/s\n";
+     if (++cycles == COLLECT_CYCLES) ready = false;
+   });
+   collector.subscribe(std::chrono::seconds(10), [&](bool final)
+   {
+     if (!final) std::cout << "stat 0 rate(10s): " << history.rate(0, 0, 10) << "/s\n";
+   });
+#ifdef COLLECTOR_CPU
+   collector.setAffinity(COLLECTOR_CPU);
+#endif
+#ifdef AGGREGATE_WORKERS
+#ifdef AGGREGATE_NUMA
+   ThreadStatsMapContainer::getInstance().setAggregateWorkers(AGGREGATE_WORKERS, true);
+#else
+   ThreadStatsMapContainer::getInstance().setAggregateWorkers(AGGREGATE_WORKERS);
+#endif
+#endif
+   raceStarted.wait();
+   collector.start();
+   workersDone.wait(); //wait for all threads to finish
+   collector.stop();   //final pass
   
    aggr.print(); 
+   aggr.getStatsMap().forEach([](uint64_t key, StatCounter& stat)
+   {
+     if (!isSelfStat(key)) collectedCount += stat.getStatValue();
+   });
+   std::cout << "stat 0 rate(10s): " << history.rate(0, 0, 10) << "/s rate(60s): " << history.rate(0, 0, 60)
+             << "/s max interval delta(5 min): " << history.maxDelta(0, 0, 300) << std::endl;
    //std::cout << "Exiting collector \n";
   
 }
@@ -329,6 +897,21 @@ void golbalStatFunc (int threadid, int id) {
   while(ready) //increment stats until it is ready 
   {
     //std::cout <<threadid<<" ready : "<<ready<<std::endl;
+#ifdef STATIC_STATS_TEST
+    /* same number of increments over the 8 compile time registered stats */
+    for(int j = 0; j < 125; ++j)
+    {
+          ThreadStatsMapContainer::s_increment<StaticStat::BENCH_STAT_0>(1);
+          ThreadStatsMapContainer::s_increment<StaticStat::BENCH_STAT_1>(1);
+          ThreadStatsMapContainer::s_increment<StaticStat::BENCH_STAT_2>(1);
+          ThreadStatsMapContainer::s_increment<StaticStat::BENCH_STAT_3>(1);
+          ThreadStatsMapContainer::s_increment<StaticStat::BENCH_STAT_4>(1);
+          ThreadStatsMapContainer::s_increment<StaticStat::BENCH_STAT_5>(1);
+          ThreadStatsMapContainer::s_increment<StaticStat::BENCH_STAT_6>(1);
+          ThreadStatsMapContainer::s_increment<StaticStat::BENCH_STAT_7>(1);
+          count += 8;
+    }
+#else
     int64_t start = id*1000;
     int64_t end = start+1000;
     for(;start<end;++start)
@@ -336,6 +919,7 @@ void golbalStatFunc (int threadid, int id) {
           ThreadStatsMapContainer::i_increment(start, 1);
           ++count;
     }
+#endif
     ++i;
     //std::this_thread::sleep_for(std::chrono::seconds(1));
   }
@@ -345,6 +929,669 @@ void golbalStatFunc (int threadid, int id) {
    globalCount += count;
 };
  
+#ifdef STAT_KINDS_TEST
+/* every thread updates the same gauge/max/min/rate/sum keys, checks the cross thread merge of each kind */
+enum { GAUGE_KEY = 1, MAX_KEY = 2, MIN_KEY = 3, RATE_KEY = 4, SUM_KEY = 5 };
+const uint64_t KIND_THREADS = 4;
+const uint64_t KIND_UPDATES = 100000;
+
+void statKindsFunc(uint64_t id)
+{
+  for (uint64_t i = 1; i <= KIND_UPDATES; ++i)
+  {
+    ThreadStatsMapContainer::i_max(MAX_KEY, (id + 1) * i);
+    ThreadStatsMapContainer::i_min(MIN_KEY, (id + 1) * i);
+    ThreadStatsMapContainer::i_rate(RATE_KEY, 1);
+    ThreadStatsMapContainer::i_increment(SUM_KEY, 2);
+  }
+  /* the last thread to set the gauge is the one with the largest id */
+  std::this_thread::sleep_for(std::chrono::milliseconds(50 * (id + 1)));
+  ThreadStatsMapContainer::i_set(GAUGE_KEY, id);
+}
+
+int main ()
+{
+  std::vector<std::thread> threads;
+  for (uint64_t i = 0; i < KIND_THREADS; ++i) threads.push_back(std::thread(statKindsFunc, i));
+  for (auto& th : threads) th.join();
+  ThreadStatsMapContainer::i_max(MAX_KEY, 7); //main thread stays alive for the next interval
+  ThreadStatsMapContainer::i_set(GAUGE_KEY + 100, 5); //set once, reported every interval
+  StatsMap stats = ThreadStatsMapContainer::getInstance().aggregate();
+
+  bool ok = true;
+  auto check = [&ok](StatsMap& stats, const char* name, uint64_t key, uint64_t expected)
+  {
+    uint64_t value = stats.getStats(key).getStatValue();
+    std::cout << name << ": " << value << (value == expected ? " OK" : " MISMATCH") << std::endl;
+    ok = ok && value == expected;
+  };
+  check(stats, "gauge", GAUGE_KEY, KIND_THREADS - 1);
+  check(stats, "max", MAX_KEY, KIND_THREADS * KIND_UPDATES);
+  check(stats, "min", MIN_KEY, 1);
+  check(stats, "rate count", RATE_KEY, KIND_THREADS * KIND_UPDATES);
+  check(stats, "sum", SUM_KEY, 2 * KIND_THREADS * KIND_UPDATES);
+  std::cout << "rate: " << stats.getRate(RATE_KEY) << " per second over " << stats.getInterval() << " s" << std::endl;
+
+  /* MAX/MIN are per interval, nothing updated in the next one */
+  StatsMap next = ThreadStatsMapContainer::getInstance().aggregate();
+  check(next, "next interval max", MAX_KEY, 0);
+  check(next, "next interval gauge", GAUGE_KEY + 100, 5);
+  return ok ? 0 : 1;
+}
+#elif defined(DIRTY_TEST)
+/* 200k stats in one thread map, time aggregate() after changing none, 1%, 10% and all of them */
+const uint64_t DIRTY_KEYS = 200000;
+
+int main ()
+{
+  for (uint64_t key = 0; key < DIRTY_KEYS; ++key) ThreadStatsMapContainer::i_increment(key, 1);
+  ThreadStatsMapContainer::getInstance().aggregate();
+  bool ok = true;
+  const uint64_t changes[] = { 0, DIRTY_KEYS / 100, DIRTY_KEYS / 10, DIRTY_KEYS };
+  for (uint64_t changed : changes)
+  {
+    uint64_t stride = changed ? DIRTY_KEYS / changed : 1;
+    for (uint64_t i = 0; i < changed; ++i) ThreadStatsMapContainer::i_increment(i * stride, 1);
+    auto start = std::chrono::high_resolution_clock::now();
+    StatsMap stats = ThreadStatsMapContainer::getInstance().aggregate();
+    auto end = std::chrono::high_resolution_clock::now();
+    uint64_t total = 0;
+    stats.getStatsMap().forEach([&total](uint64_t, StatCounter& stat) { total += stat.getStatValue(); });
+    ok = ok && total == changed;
+    std::cout << changed << " of " << DIRTY_KEYS << " stats changed: aggregate " << std::chrono::duration<double, std::milli>(end-start).count()
+              << " ms, collected " << total << (total == changed ? " OK" : " MISMATCH") << std::endl;
+  }
+  return ok ? 0 : 1;
+}
+#elif defined(AGGREGATE_SCALE_TEST)
+/* aggregate() time against the number of threads: serial, on an AggregatePool, on a numa AggregatePool */
+const uint64_t SCALE_KEYS = 1000;     //the same stat ids in every thread
+const uint32_t SCALE_ROUNDS = 5;
+const uint32_t SCALE_WORKERS = 4;
+const uint32_t SCALE_MAX_THREADS = 128;
+
+/* every round each thread bumps all its keys once, then blocks until the next round */
+struct ScaleRound
+{
+  ScaleRound() : round(0), done(0), exit(false) {}
+  std::mutex mtx;
+  std::condition_variable cv;
+  uint32_t round;
+  uint32_t done;
+  bool exit;
+};
+
+void scaleFunc(ScaleRound* sync)
+{
+  uint32_t seen = 0;
+  std::unique_lock<std::mutex> lck (sync->mtx);
+  while (true)
+  {
+    sync->cv.wait(lck, [&]() { return sync->exit || sync->round != seen; });
+    if (sync->exit) return;
+    seen = sync->round;
+    lck.unlock();
+    for (uint64_t key = 0; key < SCALE_KEYS; ++key) ThreadStatsMapContainer::i_increment(key, 1);
+    lck.lock();
+    ++sync->done;
+    sync->cv.notify_all();
+  }
+}
+
+/* average ms of one aggregate() after every thread changed all its keys */
+double timeAggregate(ScaleRound& sync, uint32_t threads, bool& ok)
+{
+  double total = 0;
+  for (uint32_t r = 0; r < SCALE_ROUNDS; ++r)
+  {
+    {
+      std::unique_lock<std::mutex> lck (sync.mtx);
+      sync.done = 0;
+      ++sync.round;
+      sync.cv.notify_all();
+      sync.cv.wait(lck, [&]() { return sync.done == threads; });
+    }
+    auto start = std::chrono::steady_clock::now();
+    StatsMap stats = ThreadStatsMapContainer::getInstance().aggregate();
+    total += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    ok = ok && stats.getStats(0).getStatValue() == threads && stats.getStats(SCALE_KEYS - 1).getStatValue() == threads;
+  }
+  return total / SCALE_ROUNDS;
+}
+
+int main ()
+{
+  ThreadStatsMapContainer& container = ThreadStatsMapContainer::getInstance();
+  bool ok = true;
+  FILE* plot = fopen("aggregate_scale.dat", "w"); //gnuplot: plot "aggregate_scale.dat" using 1:2 with lines, ...
+  if (plot) fprintf(plot, "# threads serial_ms pool_ms numa_pool_ms (%u workers, %lu keys per thread)\n", SCALE_WORKERS, SCALE_KEYS);
+  std::ostringstream table;
+  for (uint32_t threads = 1; threads <= SCALE_MAX_THREADS; threads *= 2)
+  {
+    ScaleRound sync;
+    std::vector<std::thread> workers;
+    for (uint32_t i = 0; i < threads; ++i) workers.push_back(std::thread(scaleFunc, &sync));
+    container.setAggregateWorkers(0);
+    double serial = timeAggregate(sync, threads, ok);
+    container.setAggregateWorkers(SCALE_WORKERS);
+    double pool = timeAggregate(sync, threads, ok);
+    container.setAggregateWorkers(SCALE_WORKERS, true);
+    double numa = timeAggregate(sync, threads, ok);
+    {
+      std::lock_guard<std::mutex> lck (sync.mtx);
+      sync.exit = true;
+    }
+    sync.cv.notify_all();
+    for (auto& worker : workers) worker.join();
+    container.setAggregateWorkers(0);
+    container.aggregate(); //retires the maps of the exited threads
+    if (plot) fprintf(plot, "%u %f %f %f\n", threads, serial, pool, numa);
+    table << threads << " threads: serial " << serial << " ms, pool " << pool << " ms, numa pool " << numa << " ms\n";
+  }
+  if (plot) fclose(plot);
+  std::cout << table.str() << (ok ? "aggregated values OK" : "aggregated values MISMATCH") << std::endl;
+  return ok ? 0 : 1;
+}
+#elif defined(SIMD_TEST)
+/* dense counter arrays: StatCounter operator+= loop vs the SimdKernels add / delta of every implementation */
+const size_t SIMD_COUNTERS[] = { 64, 1024, 16384 };
+const uint64_t SIMD_WORK = 1 << 26; //counters processed per measurement
+
+template <typename F>
+double nsPerCounter(size_t n, F f)
+{
+  uint64_t loops = std::max<uint64_t>(1, SIMD_WORK / n);
+  auto start = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < loops; ++i) f();
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / (loops * n);
+}
+
+/* every implementation against the scalar one, lengths covering the vector tails */
+bool checkKernels(SimdKernels::Isa best)
+{
+  bool ok = true;
+  for (int isa = SimdKernels::SCALAR; isa <= best; ++isa)
+  {
+    SimdKernels::AddFn add = SimdKernels::addFor(static_cast<SimdKernels::Isa>(isa));
+    SimdKernels::DeltaFn delta = SimdKernels::deltaFor(static_cast<SimdKernels::Isa>(isa));
+    for (size_t n = 0; n <= 40; ++n)
+    {
+      std::vector<uint64_t> dst(n + 1), src(n + 1), current(n + 1), seen(n + 1), out(n + 1, 7);
+      for (size_t i = 0; i <= n; ++i)
+      {
+        dst[i] = i * 0x9E3779B97F4A7C15ULL;
+        src[i] = ~i;
+        current[i] = i % 3 ? i * 5 : 0;
+        seen[i] = i % 3 ? i : 0;
+      }
+      std::vector<uint64_t> expected(dst);
+      for (size_t i = 0; i < n; ++i) expected[i] += src[i];
+      add(&dst[0], &src[0], n);
+      bool changed = delta(&out[0], &current[0], &seen[0], n);
+      ok = ok && dst == expected && changed == (n > 1) && 7 == out[n]; //no write past n
+      for (size_t i = 0; i < n; ++i) ok = ok && out[i] == (i % 3 ? i * 4 : 0) && seen[i] == current[i];
+      ok = ok && !delta(&out[0], &current[0], &seen[0], n); //nothing changed since
+    }
+  }
+  return ok;
+}
+
+int main ()
+{
+  SimdKernels::Isa best = SimdKernels::best();
+  bool ok = checkKernels(best);
+  std::cout << "best implementation: " << SimdKernels::name(best) << ", kernels " << (ok ? "OK" : "MISMATCH") << std::endl;
+  for (size_t n : SIMD_COUNTERS)
+  {
+    std::vector<StatCounter> total(n), other(n);
+    std::vector<uint64_t> dst(n, 1), src(n, 2), current(n, 3), seen(n, 0), out(n);
+    std::unique_ptr<std::atomic<uint64_t>[]> counters(new std::atomic<uint64_t>[n]);
+    for (size_t i = 0; i < n; ++i) counters[i].store(3, std::memory_order_relaxed);
+    double counterNs = nsPerCounter(n, [&]() { for (size_t i = 0; i < n; ++i) total[i] += other[i]; });
+    double loadNs = nsPerCounter(n, [&]() { SimdKernels::load(&current[0], counters.get(), n); });
+    std::cout << n << " counters: StatCounter += " << counterNs << " ns/counter, relaxed copy (load) " << loadNs << " ns/counter\n";
+    for (int isa = SimdKernels::SCALAR; isa <= best; ++isa)
+    {
+      SimdKernels::AddFn add = SimdKernels::addFor(static_cast<SimdKernels::Isa>(isa));
+      SimdKernels::DeltaFn delta = SimdKernels::deltaFor(static_cast<SimdKernels::Isa>(isa));
+      double addNs = nsPerCounter(n, [&]() { add(&dst[0], &src[0], n); });
+      double deltaNs = nsPerCounter(n, [&]() { delta(&out[0], &current[0], &seen[0], n); });
+      std::cout << "   " << SimdKernels::name(static_cast<SimdKernels::Isa>(isa)) << ": add " << addNs
+                << " ns/counter, delta " << deltaNs << " ns/counter\n";
+    }
+  }
+  return ok ? 0 : 1;
+}
+#elif defined(BATCH_TEST)
+/* packet loop: every thread bumps the same 4 keys, per call i_increment vs StatBatch vs i_increment_many */
+enum BatchMode { PER_CALL, STAT_BATCH, INC_MANY };
+const uint64_t BATCH_KEYS = 4;
+const uint64_t BATCH_LOOP = 1000;
+
+void batchFunc(uint64_t id, BatchMode mode, std::atomic<uint64_t>* total)
+{
+  uint64_t base = id * 100; //keys of this thread: base .. base + 3
+  uint64_t count = 0;
+  while (!ready) {}
+  if (PER_CALL == mode)
+  {
+    while (ready)
+    {
+      for (uint64_t i = 0; i < BATCH_LOOP; ++i)
+        for (uint64_t k = 0; k < BATCH_KEYS; ++k) ThreadStatsMapContainer::i_increment(base + k, 1);
+      count += BATCH_LOOP * BATCH_KEYS;
+    }
+  }
+  else if (STAT_BATCH == mode)
+  {
+    StatBatch b0(base), b1(base + 1), b2(base + 2), b3(base + 3);
+    while (ready)
+    {
+      for (uint64_t i = 0; i < BATCH_LOOP; ++i) { b0.inc(); b1.inc(); b2.inc(); b3.inc(); }
+      count += BATCH_LOOP * BATCH_KEYS;
+    }
+  }
+  else
+  {
+    std::vector<uint64_t> keys(BATCH_LOOP * BATCH_KEYS), vals(BATCH_LOOP * BATCH_KEYS, 1);
+    for (size_t i = 0; i < keys.size(); ++i) keys[i] = base + i % BATCH_KEYS;
+    while (ready)
+    {
+      ThreadStatsMapContainer::i_increment_many(keys.data(), vals.data(), keys.size());
+      count += keys.size();
+    }
+  }
+  *total += count;
+}
+
+uint64_t totalValue(StatsMap& stats)
+{
+  uint64_t total = 0;
+  stats.getStatsMap().forEach([&total](uint64_t, StatCounter& stat) { total += stat.getStatValue(); });
+  return total;
+}
+
+int main ()
+{
+  const char* names[] = { "i_increment     ", "StatBatch       ", "i_increment_many" };
+  bool ok = true;
+  for (int mode = PER_CALL; mode <= INC_MANY; ++mode)
+  {
+    std::atomic<uint64_t> total(0);
+    std::vector<std::thread> threads;
+    ready = false;
+    for (uint64_t i = 0; i < 4; ++i) threads.push_back(std::thread(batchFunc, i, BatchMode(mode), &total));
+    ready = true;
+    std::this_thread::sleep_for(std::chrono::seconds(3));
+    ready = false;
+    for (auto& th : threads) th.join();
+    StatsMap stats = ThreadStatsMapContainer::getInstance().aggregate();
+    uint64_t collected = totalValue(stats);
+    ok = ok && collected == total;
+    std::cout << names[mode] << ": " << (uint64_t)(total / 3.0) << " increments/sec, collected "
+              << collected << (collected == total ? " OK" : " MISMATCH") << std::endl;
+  }
+  return ok ? 0 : 1;
+}
+#elif defined(CHURN_TEST)
+/*
+ * thread churn: waves of short lived threads, each updates dynamic keys, a compile time stat and a StatBatch and
+ * exits, while the collector drains the exited maps every millisecond and aggregates every 10. The sum of all the
+ * intervals must be exact.
+ */
+#ifndef CHURN_SECONDS
+#define CHURN_SECONDS 3
+#endif
+void churnFunc(uint64_t id)
+{
+  for (uint64_t key = 0; key < 16; ++key) ThreadStatsMapContainer::i_increment(key, key + 1);
+  ThreadStatsMapContainer::s_increment<StaticStat::BENCH_STAT_0>(2);
+  StatBatch batch(100);
+  for (uint32_t i = 0; i < 1000; ++i) batch.inc();
+  ThreadStatsMapContainer::i_increment(1000 + id % 64, 1);
+}
+
+int main ()
+{
+  ThreadStatsMapContainer& container = ThreadStatsMapContainer::getInstance();
+  std::atomic<bool> collecting(true);
+  StatsMap total;
+  uint64_t drains = 0, intervals = 0;
+  std::thread collector([&]()
+  {
+    while (collecting)
+    {
+      container.drainExited();
+      if (0 == ++drains % 10)
+      {
+         StatsMap interval = container.aggregate();
+         total += interval;
+         ++intervals;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+  uint64_t threads = 0;
+  auto start = std::chrono::steady_clock::now();
+  while (std::chrono::steady_clock::now() - start < std::chrono::seconds(CHURN_SECONDS))
+  {
+     std::vector<std::thread> wave;
+     for (uint32_t i = 0; i < 8; ++i) wave.push_back(std::thread(churnFunc, threads++));
+     for (auto& th : wave) th.join();
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  collecting = false;
+  collector.join();
+  StatsMap interval = container.aggregate();
+  total += interval;
+
+  bool ok = true;
+  for (uint64_t key = 0; key < 16; ++key) ok = ok && total.getStats(key).getStatValue() == (key + 1) * threads;
+  uint64_t spread = 0;
+  for (uint64_t key = 1000; key < 1064; ++key) spread += total.getStats(key).getStatValue();
+  ok = ok && spread == threads && total.getStats(100).getStatValue() == 1000 * threads
+          && total.getStats(StaticStatId<StaticStat::BENCH_STAT_0>::value).getStatValue() == 2 * threads;
+  std::cout << threads << " threads in " << elapsed.count() << " s (" << threads / elapsed.count() << " threads/s), "
+            << drains << " drains, " << intervals + 1 << " intervals: key 15 " << total.getStats(15).getStatValue()
+            << " batch " << total.getStats(100).getStatValue() << " static "
+            << total.getStats(StaticStatId<StaticStat::BENCH_STAT_0>::value).getStatValue() << (ok ? " OK" : " MISMATCH")
+            << std::endl;
+  return ok ? 0 : 1;
+}
+#elif defined(VERIFY_TEST)
+/*
+ * exactly once accounting under randomized schedules: long lived writers, waves of short lived threads and the
+ * collector run together for VERIFY_SECONDS. Every thread draws its updates (i_increment on hot or new keys,
+ * s_increment, StatBatch with a random flush period, i_increment_many bursts, i_rate, i_max, i_min, i_set on the
+ * own gauge of a long lived writer) and its pauses from its own generator and counts what it wrote; the collector
+ * aggregates, drains the exited maps and switches the aggregate workers at random intervals. The sum of the
+ * intervals must equal, key by key, what the threads wrote: the sum (SUM, RATE, static), the largest (MAX) or
+ * smallest (MIN) value, the last value set (GAUGE).
+ * The updates of a thread depend only on the seed (printed, -DVERIFY_SEED=<seed> replays them), the interleaving
+ * is left to the scheduler.
+ */
+#ifndef VERIFY_SECONDS
+#define VERIFY_SECONDS 5
+#endif
+#ifndef VERIFY_WRITERS
+#define VERIFY_WRITERS 4
+#endif
+#ifndef VERIFY_CHURN
+#define VERIFY_CHURN 2 //threads starting short lived threads
+#endif
+const uint64_t VERIFY_KEYS = 4096; //dynamic keys 0 .. 4095, the static stats and the RATE keys are counted after them
+const uint64_t VERIFY_RATE_KEY = 100000;  //RATE keys VERIFY_RATE_KEY + 0 .. 63
+const uint64_t VERIFY_RATE_KEYS = 64;
+const uint64_t VERIFY_MAX_KEY = 200000;   //MAX keys VERIFY_MAX_KEY + 0 .. 15
+const uint64_t VERIFY_MIN_KEY = 300000;   //MIN keys VERIFY_MIN_KEY + 0 .. 15
+const uint64_t VERIFY_EXTREMA = 16;
+const uint64_t VERIFY_GAUGE_KEY = 400000; //GAUGE key of long lived writer i: VERIFY_GAUGE_KEY + i
+
+/* xorshift64*, one per thread */
+struct VerifyRng
+{
+  explicit VerifyRng(uint64_t seed) : _state((seed + 1) * 0x9E3779B97F4A7C15ULL) { if (0 == _state) _state = 1; }
+  uint64_t next()
+  {
+    _state ^= _state >> 12;
+    _state ^= _state << 25;
+    _state ^= _state >> 27;
+    return _state * 0x2545F4914F6CDD1DULL;
+  }
+  uint64_t below(uint64_t n) { return next() % n; }
+  uint64_t _state;
+};
+
+typedef void (*StaticInc)(uint64_t);
+const StaticInc VERIFY_STATIC[] = {
+  &ThreadStatsMapContainer::s_increment<StaticStat::BENCH_STAT_0>, &ThreadStatsMapContainer::s_increment<StaticStat::BENCH_STAT_1>,
+  &ThreadStatsMapContainer::s_increment<StaticStat::BENCH_STAT_2>, &ThreadStatsMapContainer::s_increment<StaticStat::BENCH_STAT_3>,
+  &ThreadStatsMapContainer::s_increment<StaticStat::BENCH_STAT_4>, &ThreadStatsMapContainer::s_increment<StaticStat::BENCH_STAT_5>,
+  &ThreadStatsMapContainer::s_increment<StaticStat::BENCH_STAT_6>, &ThreadStatsMapContainer::s_increment<StaticStat::BENCH_STAT_7> };
+
+/* what the threads wrote, every thread adds its counts when it stops */
+std::mutex ledgerMtx;
+std::vector<uint64_t> ledger(VERIFY_KEYS + STATIC_STATS_COUNT + VERIFY_RATE_KEYS, 0); //summed keys
+std::vector<uint64_t> ledgerMax(VERIFY_EXTREMA, 0);
+std::vector<uint64_t> ledgerMin(VERIFY_EXTREMA, StatCounter::MIN_EMPTY);
+std::vector<uint64_t> ledgerGauge(VERIFY_WRITERS, 0); //last value set, 0: never set
+std::atomic<uint64_t> verifyUpdates(0);
+std::atomic<uint64_t> verifyThreads(0);
+
+/* a thread of the test: its writes, recorded in expected; writer >= 0 is a long lived writer, it owns a gauge */
+struct VerifyWriter
+{
+  explicit VerifyWriter(uint64_t seed, int writer = -1)
+   : _rng(seed), _expected(ledger.size(), 0), _max(VERIFY_EXTREMA, 0), _min(VERIFY_EXTREMA, StatCounter::MIN_EMPTY)
+   , _writer(writer), _gauge(0), _batchKey(0), _updates(0) {}
+  ~VerifyWriter()
+  {
+    _batch.reset(); //flushes
+    std::lock_guard<std::mutex> lck (ledgerMtx);
+    for (size_t i = 0; i < ledger.size(); ++i) ledger[i] += _expected[i];
+    for (size_t i = 0; i < VERIFY_EXTREMA; ++i)
+    {
+      ledgerMax[i] = std::max(ledgerMax[i], _max[i]);
+      ledgerMin[i] = std::min(ledgerMin[i], _min[i]);
+    }
+    if (_writer >= 0) ledgerGauge[_writer] = _gauge;
+    verifyUpdates += _updates;
+  }
+  /* mostly a few hot keys, sometimes any key: the table grows under the StatBatch slots */
+  uint64_t key() { return _rng.below(8) ? _rng.below(64) : _rng.below(VERIFY_KEYS); }
+  void step()
+  {
+    uint64_t val = 1 + _rng.below(4);
+    switch (_rng.below(20))
+    {
+      case 0: case 1: case 2: case 3: case 4: case 5: case 6: case 7: case 8: case 9:
+      {
+        uint64_t k = key();
+        ThreadStatsMapContainer::i_increment(k, val);
+        _expected[k] += val;
+        break;
+      }
+      case 10:
+      {
+        uint64_t idx = _rng.below(STATIC_STATS_COUNT);
+        VERIFY_STATIC[idx](val);
+        _expected[VERIFY_KEYS + idx] += val;
+        break;
+      }
+      case 11: case 12:
+        if (!_batch) return;
+        _batch->inc(val);
+        _expected[_batchKey] += val;
+        break;
+      case 13:
+        _batchKey = key();
+        _batch.reset(); //the previous one flushes
+        _batch.reset(new StatBatch(_batchKey, 1 + _rng.below(64)));
+        return;
+      case 14:
+      {
+        uint64_t keys[16], vals[16];
+        size_t n = 1 + _rng.below(16);
+        for (size_t i = 0; i < n; ++i)
+        {
+          keys[i] = key();
+          vals[i] = val;
+          _expected[keys[i]] += val;
+        }
+        ThreadStatsMapContainer::i_increment_many(keys, vals, n);
+        _updates += n;
+        return;
+      }
+      case 15:
+      {
+        uint64_t idx = _rng.below(VERIFY_RATE_KEYS);
+        ThreadStatsMapContainer::i_rate(VERIFY_RATE_KEY + idx, val);
+        _expected[VERIFY_KEYS + STATIC_STATS_COUNT + idx] += val;
+        break;
+      }
+      case 16:
+      {
+        uint64_t idx = _rng.below(VERIFY_EXTREMA), value = 1 + _rng.below(1 << 20);
+        ThreadStatsMapContainer::i_max(VERIFY_MAX_KEY + idx, value);
+        _max[idx] = std::max(_max[idx], value);
+        break;
+      }
+      case 17:
+      {
+        uint64_t idx = _rng.below(VERIFY_EXTREMA), value = 1 + _rng.below(1 << 20);
+        ThreadStatsMapContainer::i_min(VERIFY_MIN_KEY + idx, value);
+        _min[idx] = std::min(_min[idx], value);
+        break;
+      }
+      case 18:
+        if (_writer < 0) return;
+        _gauge = 1 + _rng.below(1 << 20);
+        ThreadStatsMapContainer::i_set(VERIFY_GAUGE_KEY + _writer, _gauge);
+        break;
+      default:
+        if (_rng.below(2)) std::this_thread::yield();
+        else std::this_thread::sleep_for(std::chrono::microseconds(_rng.below(50)));
+        return;
+    }
+    ++_updates;
+  }
+  VerifyRng _rng;
+  std::vector<uint64_t> _expected;
+  std::vector<uint64_t> _max;
+  std::vector<uint64_t> _min;
+  int _writer;
+  uint64_t _gauge;
+  std::unique_ptr<StatBatch> _batch;
+  uint64_t _batchKey;
+  uint64_t _updates;
+};
+
+void verifyWriter(uint64_t seed, int index, std::atomic<bool>* running)
+{
+  VerifyWriter writer(seed, index);
+  while (*running)
+    for (uint32_t i = 0; i < 1000; ++i) writer.step();
+}
+
+/* waves of 1 to 4 threads doing up to 2000 updates each, then exiting */
+void verifyChurn(uint64_t seed, std::atomic<bool>* running)
+{
+  VerifyRng rng(seed);
+  while (*running)
+  {
+    std::vector<std::thread> wave;
+    for (uint64_t i = 1 + rng.below(4); i > 0; --i)
+    {
+      wave.push_back(std::thread([](uint64_t threadSeed, uint64_t steps)
+      {
+        VerifyWriter writer(threadSeed);
+        for (uint64_t s = 0; s < steps; ++s) writer.step();
+      }, rng.next(), rng.below(2000)));
+    }
+    for (auto& th : wave) th.join();
+    verifyThreads += wave.size();
+  }
+}
+
+int main ()
+{
+#ifdef VERIFY_SEED
+  uint64_t seed = VERIFY_SEED;
+#else
+  uint64_t seed = std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+  ThreadStatsMapContainer& container = ThreadStatsMapContainer::getInstance();
+  container.enableSelfStats(); //recorded by the collector thread, not part of the written keys
+  std::atomic<bool> running(true);
+  std::atomic<bool> collecting(true);
+  StatsMap total;
+  uint64_t passes = 0, drains = 0;
+  std::thread collector([&]()
+  {
+    VerifyRng rng(seed);
+    while (collecting)
+    {
+      uint64_t op = rng.below(16);
+      if (op < 6)
+      {
+        StatsMap interval = container.aggregate();
+        total += interval;
+        ++passes;
+      }
+      else if (op < 14)
+      {
+        container.drainExited();
+        ++drains;
+      }
+      else if (14 == op) container.setAggregateWorkers(rng.below(3));
+      std::this_thread::sleep_for(std::chrono::microseconds(rng.below(2000)));
+    }
+  });
+  std::vector<std::thread> threads;
+  auto start = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < VERIFY_WRITERS; ++i) threads.push_back(std::thread(verifyWriter, seed + 1 + i, int(i), &running));
+  for (uint64_t i = 0; i < VERIFY_CHURN; ++i) threads.push_back(std::thread(verifyChurn, seed + 1001 + i, &running));
+  std::this_thread::sleep_for(std::chrono::seconds(VERIFY_SECONDS));
+  running = false;
+  for (auto& th : threads) th.join();
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  collecting = false;
+  collector.join();
+  container.setAggregateWorkers(0);
+  StatsMap interval = container.aggregate();
+  total += interval;
+
+  uint64_t mismatches = 0, collected = 0, expected = 0;
+  auto summed = [](uint64_t key)
+  {
+    return key < VERIFY_KEYS || (key >= STATIC_STAT_IDS[0] && key < STATIC_STAT_IDS[0] + STATIC_STATS_COUNT)
+           || (key >= VERIFY_RATE_KEY && key < VERIFY_RATE_KEY + VERIFY_RATE_KEYS);
+  };
+  total.getStatsMap().forEach([&](uint64_t key, StatCounter& stat)
+  {
+    if (isSelfStat(key)) return;
+    bool known = summed(key) || (key >= VERIFY_MAX_KEY && key < VERIFY_MAX_KEY + VERIFY_EXTREMA)
+                 || (key >= VERIFY_MIN_KEY && key < VERIFY_MIN_KEY + VERIFY_EXTREMA)
+                 || (key >= VERIFY_GAUGE_KEY && key < VERIFY_GAUGE_KEY + VERIFY_WRITERS);
+    if (summed(key)) collected += stat.getStatValue();
+    if (!known && 0 != stat.getStatValue() && 0 == mismatches++) std::cout << "unexpected key " << key << std::endl;
+  });
+  /* value and kind the total must hold for key */
+  auto check = [&](uint64_t key, uint64_t written, StatKind::Type kind)
+  {
+    StatCounter& stat = total.getStats(key);
+    if ((stat.getStatValue() != written || stat.getKind() != kind) && mismatches++ < 10)
+      std::cout << "key " << key << ": written " << written << " kind " << int(kind) << " collected "
+                << stat.getStatValue() << " kind " << int(stat.getKind()) << std::endl;
+  };
+  for (uint64_t i = 0; i < ledger.size(); ++i)
+  {
+    uint64_t rate = VERIFY_KEYS + STATIC_STATS_COUNT;
+    uint64_t key = i < VERIFY_KEYS ? i : i < rate ? STATIC_STAT_IDS[i - VERIFY_KEYS] : VERIFY_RATE_KEY + i - rate;
+    expected += ledger[i];
+    if (ledger[i]) check(key, ledger[i], i < rate ? StatKind::SUM : StatKind::RATE);
+    else if (total.getStats(key).getStatValue()) check(key, 0, StatKind::SUM);
+  }
+  for (uint64_t i = 0; i < VERIFY_EXTREMA; ++i)
+  {
+    if (ledgerMax[i]) check(VERIFY_MAX_KEY + i, ledgerMax[i], StatKind::MAX);
+    if (StatCounter::MIN_EMPTY != ledgerMin[i]) check(VERIFY_MIN_KEY + i, ledgerMin[i], StatKind::MIN);
+  }
+  for (uint64_t i = 0; i < VERIFY_WRITERS; ++i)
+  {
+    if (ledgerGauge[i]) check(VERIFY_GAUGE_KEY + i, ledgerGauge[i], StatKind::GAUGE);
+  }
+  std::cout << "seed " << seed << ": " << VERIFY_WRITERS << " writers, " << verifyThreads << " short lived threads ("
+            << verifyThreads / elapsed.count() << " threads/s), " << passes + 1 << " aggregates, " << drains << " drains in "
+            << elapsed.count() << " s\n"
+            << (uint64_t)(verifyUpdates / elapsed.count()) << " updates/sec, written " << expected << " collected "
+            << collected << ", " << mismatches << " mismatches " << (mismatches ? "FAIL" : "PASS") << "\n"
+            << "self: " << total.getStats(SELF_LOCK_WAIT_NS_STAT_ID).getStatValue() / 1e6 << " ms lock wait, "
+            << total.getStats(SELF_ALLOCATIONS_STAT_ID).getStatValue() << " table allocations, "
+            << total.getStats(SELF_NEW_KEYS_STAT_ID).getStatValue() << " keys created" << std::endl;
+  return mismatches ? 1 : 0;
+}
+#else
 //to test performance set macro LOCAL_ATOMIC to 0 for global stats  and 1  for localized stats
 int main ()
 {
@@ -359,6 +1606,7 @@ int main ()
   std::this_thread::sleep_for(std::chrono::seconds(1));
   auto start = std::chrono::high_resolution_clock::now();
   ready = true; //lets start the race
+  raceStarted.set();
 
   std::cout<<" waiting for join thread\n";
   //wait for all gloabl threads
@@ -372,11 +1620,15 @@ int main ()
   std::cout << "Waited " << elapsed.count() << " ms\n";
   
   //its the time for display data 
-  dumpCollectedStats = true;
+  workersDone.set();
 
   //now wait for collector thread
   collector.join(); 
   std::cout<<globalCount<<" number of stats incremented in "<<elapsed.count() << " ms\n";
+  std::cout<<(uint64_t)(globalCount / (elapsed.count() / 1000))<<" increments/sec\n";
+  std::cout<<collectedCount<<" collected "<<(collectedCount == globalCount ? "OK" : "MISMATCH")<<"\n";
   //std::cout << "completed collector join  \n";
+  return collectedCount == globalCount ? 0 : 1;
 }
-
+#endif
+#endif /* STATS_NO_MAIN */
@@ -0,0 +1,429 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _BENCHMARK_H
+#define _BENCHMARK_H
+
+/*
+ * Benchmark.h - small Google Benchmark style harness of the stats benchmarks (Test/bench_*.cpp).
+ *
+ *    void benchInc(bench::State& state)
+ *    {
+ *       GlobalStats stat(1);                          //per thread setup, not timed
+ *       while (state.keepRunning()) stat.inc();       //timed, one op per call
+ *    }
+ *    BENCHMARK_CASE(benchInc, "global_stats/inc").threads({1, 2, 4, 8}).arg("keys", {1, 64, 4096});
+ *    int main(int argc, char** argv) { return bench::runAll(argc, argv); }
+ *
+ * Every (threads, args) combination is a run: the case function runs on that many new threads, they are released
+ * together by a barrier (no busy wait on a flag), the iteration count grows until a run lasts --min_time and the
+ * run is repeated --repetitions times. ns/op is the wall time of a run divided by the iterations of one thread
+ * (median, min and max of the repetitions), ops/s counts the ops of all the threads.
+ * Extra values (collector pass time, bytes per stat) are reported with state.setCounter(), thread 0 values win.
+ *
+ *    --filter=text        runs whose name contains text
+ *    --min_time=seconds   per repetition (default 0.1)
+ *    --repetitions=n      (default 3)
+ *    --json=file          all the results, one run per line
+ *    --baseline=file      json of a previous run, exit 1 if a run got slower than --threshold percent (default 10)
+ */
+namespace bench
+{
+
+/* keeps a value the compiler could prove unused, and the stores before it */
+template <typename T>
+inline void doNotOptimize(T& value) { asm volatile("" : "+m"(value) : : "memory"); }
+
+class Barrier
+{
+  public:
+     explicit Barrier(uint32_t count) : _count(count), _waiting(0), _generation(0) {}
+     /* true for the last thread to arrive, it runs last() before the others are released */
+     template <typename F>
+     bool wait(F last)
+     {
+        std::unique_lock<std::mutex> lck (_mtx);
+        uint64_t generation = _generation;
+        if (++_waiting == _count)
+        {
+           last();
+           _waiting = 0;
+           ++_generation;
+           _cv.notify_all();
+           return true;
+        }
+        _cv.wait(lck, [&]() { return generation != _generation; });
+        return false;
+     }
+  private:
+     std::mutex _mtx;
+     std::condition_variable _cv;
+     uint32_t _count;
+     uint32_t _waiting;
+     uint64_t _generation;
+};
+
+/* what the threads of one run share */
+struct RunContext
+{
+  explicit RunContext(uint32_t threads) : barrier(threads), wallNs(0), pausedNs(0) {}
+  Barrier barrier;
+  std::chrono::steady_clock::time_point start;
+  uint64_t wallNs;
+  std::atomic<uint64_t> pausedNs;
+  std::map<std::string, double> counters;
+  std::mutex counterMtx;
+};
+
+class State
+{
+  public:
+     State(RunContext& context, uint64_t iterations, uint32_t threadIndex, uint32_t threads,
+           const std::map<std::string, int64_t>& args)
+      : _context(context), _left(iterations), _iterations(iterations), _started(false)
+        , _threadIndex(threadIndex), _threads(threads), _args(args)
+     {}
+     /* the first call starts the clock once every thread is there, false once the iterations are done */
+     bool keepRunning()
+     {
+        if (__builtin_expect(_left > 0 && _started, 1))
+        {
+           --_left;
+           return true;
+        }
+        if (!_started)
+        {
+           _started = true;
+           _context.barrier.wait([this]() { _context.start = std::chrono::steady_clock::now(); });
+           if (_left > 0)
+           {
+              --_left;
+              return true;
+           }
+        }
+        _context.barrier.wait([this]()
+        {
+           _context.wallNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()
+                           - _context.start).count();
+        });
+        return false;
+     }
+     /* single thread runs: untimed work inside the loop (e.g. making counters dirty before a collector pass) */
+     void pauseTiming() { _pause = std::chrono::steady_clock::now(); }
+     void resumeTiming()
+     {
+        _context.pausedNs += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()
+                           - _pause).count();
+     }
+     uint64_t iterations() const { return _iterations; }
+     uint32_t threadIndex() const { return _threadIndex; }
+     uint32_t threads() const { return _threads; }
+     int64_t arg(const std::string& name) const
+     {
+        std::map<std::string, int64_t>::const_iterator it = _args.find(name);
+        return it == _args.end() ? 0 : it->second;
+     }
+     void setCounter(const std::string& name, double value)
+     {
+        std::lock_guard<std::mutex> lck (_context.counterMtx);
+        if (0 == _threadIndex || 0 == _context.counters.count(name)) _context.counters[name] = value;
+     }
+  private:
+     RunContext& _context;
+     uint64_t _left;
+     uint64_t _iterations;
+     bool _started;
+     uint32_t _threadIndex;
+     uint32_t _threads;
+     const std::map<std::string, int64_t>& _args;
+     std::chrono::steady_clock::time_point _pause;
+};
+
+typedef void (*CaseFn)(State&);
+
+class Case
+{
+  public:
+     Case(CaseFn fn, const std::string& name) : _fn(fn), _name(name), _threads(1, 1) {}
+     Case& threads(std::initializer_list<uint32_t> counts) { _threads.assign(counts); return *this; }
+     /* several args run their cross product */
+     Case& arg(const std::string& name, std::initializer_list<int64_t> values)
+     {
+        _args.push_back(std::make_pair(name, std::vector<int64_t>(values)));
+        return *this;
+     }
+     CaseFn fn() const { return _fn; }
+     const std::string& name() const { return _name; }
+     const std::vector<uint32_t>& threadCounts() const { return _threads; }
+     /* every combination of the arg values */
+     std::vector<std::map<std::string, int64_t> > argSets() const
+     {
+        std::vector<std::map<std::string, int64_t> > sets(1);
+        for (auto& arg : _args)
+        {
+           std::vector<std::map<std::string, int64_t> > next;
+           for (auto& set : sets)
+           {
+              for (int64_t value : arg.second)
+              {
+                 next.push_back(set);
+                 next.back()[arg.first] = value;
+              }
+           }
+           sets.swap(next);
+        }
+        return sets;
+     }
+     const std::vector<std::pair<std::string, std::vector<int64_t> > >& args() const { return _args; }
+  private:
+     CaseFn _fn;
+     std::string _name;
+     std::vector<uint32_t> _threads;
+     std::vector<std::pair<std::string, std::vector<int64_t> > > _args; //< in declaration order
+};
+
+inline std::vector<Case*>& registry()
+{
+   static std::vector<Case*> cases;
+   return cases;
+}
+inline Case& registerCase(CaseFn fn, const char* name)
+{
+   registry().push_back(new Case(fn, name));
+   return *registry().back();
+}
+
+#define BENCHMARK_CONCAT2(a, b) a##b
+#define BENCHMARK_CONCAT(a, b) BENCHMARK_CONCAT2(a, b)
+#define BENCHMARK_CASE(fn, name) \
+   static bench::Case& BENCHMARK_CONCAT(_benchCase, __LINE__) __attribute__((unused)) = bench::registerCase(fn, name)
+
+struct Result
+{
+  std::string name;
+  std::string caseName;
+  uint32_t threads;
+  std::map<std::string, int64_t> args;
+  uint64_t iterations;
+  double nsPerOp;      //< median of the repetitions
+  double nsPerOpMin;
+  double nsPerOpMax;
+  double opsPerSec;
+  std::map<std::string, double> counters;
+};
+
+struct Options
+{
+  Options() : minTime(0.1), repetitions(3), threshold(10) {}
+  std::string filter;
+  double minTime;
+  uint32_t repetitions;
+  std::string json;
+  std::string baseline;
+  double threshold;
+};
+
+/* one run of iterations per thread, wall ns (minus paused time) */
+inline uint64_t runOnce(const Case& c, uint32_t threads, const std::map<std::string, int64_t>& args, uint64_t iterations,
+                        std::map<std::string, double>& counters)
+{
+   RunContext context(threads);
+   std::vector<std::thread> workers;
+   for (uint32_t i = 0; i < threads; ++i)
+   {
+      workers.push_back(std::thread([&, i]()
+      {
+         State state(context, iterations, i, threads, args);
+         c.fn()(state);
+      }));
+   }
+   for (auto& worker : workers) worker.join();
+   counters = context.counters;
+   uint64_t paused = context.pausedNs.load();
+   return context.wallNs > paused ? context.wallNs - paused : 1;
+}
+
+/* case/arg:value.../threads:n */
+inline std::string runName(const Case& c, uint32_t threads, const std::map<std::string, int64_t>& args)
+{
+   std::ostringstream name;
+   name << c.name();
+   for (auto& arg : c.args()) name << "/" << arg.first << ":" << args.find(arg.first)->second;
+   name << "/threads:" << threads;
+   return name.str();
+}
+
+inline Result run(const Case& c, uint32_t threads, const std::map<std::string, int64_t>& args, const Options& options)
+{
+   Result result;
+   result.caseName = c.name();
+   result.threads = threads;
+   result.args = args;
+   result.name = runName(c, threads, args);
+
+   /* grow the iterations until one run lasts minTime */
+   uint64_t minNs = static_cast<uint64_t>(options.minTime * 1e9);
+   uint64_t iterations = 1;
+   std::map<std::string, double> counters;
+   uint64_t ns = runOnce(c, threads, args, iterations, counters);
+   while (ns < minNs && iterations < (1ULL << 40))
+   {
+      double factor = std::min(10.0, std::max(1.5, 1.4 * minNs / std::max<uint64_t>(ns, 1)));
+      iterations = static_cast<uint64_t>(iterations * factor) + 1;
+      ns = runOnce(c, threads, args, iterations, counters);
+   }
+   std::vector<double> perOp;
+   for (uint32_t r = 0; r < std::max(1u, options.repetitions); ++r)
+   {
+      perOp.push_back(static_cast<double>(runOnce(c, threads, args, iterations, counters)) / iterations);
+   }
+   std::sort(perOp.begin(), perOp.end());
+   result.iterations = iterations;
+   result.nsPerOp = perOp[perOp.size() / 2];
+   result.nsPerOpMin = perOp.front();
+   result.nsPerOpMax = perOp.back();
+   result.opsPerSec = threads * 1e9 / result.nsPerOp;
+   result.counters = counters;
+   return result;
+}
+
+inline std::string jsonLine(const Result& result)
+{
+   std::ostringstream out;
+   out << "{\"name\": \"" << result.name << "\", \"case\": \"" << result.caseName << "\", \"threads\": " << result.threads
+       << ", \"args\": {";
+   const char* sep = "";
+   for (auto& arg : result.args)
+   {
+      out << sep << "\"" << arg.first << "\": " << arg.second;
+      sep = ", ";
+   }
+   out << "}, \"iterations\": " << result.iterations << ", \"ns_per_op\": " << result.nsPerOp
+       << ", \"ns_per_op_min\": " << result.nsPerOpMin << ", \"ns_per_op_max\": " << result.nsPerOpMax
+       << ", \"ops_per_sec\": " << result.opsPerSec << ", \"counters\": {";
+   sep = "";
+   for (auto& counter : result.counters)
+   {
+      out << sep << "\"" << counter.first << "\": " << counter.second;
+      sep = ", ";
+   }
+   out << "}}";
+   return out.str();
+}
+
+/* name -> ns_per_op of a json written by --json, one run per line */
+inline std::map<std::string, double> readBaseline(const std::string& path)
+{
+   std::map<std::string, double> baseline;
+   std::ifstream in(path.c_str());
+   std::string line;
+   while (std::getline(in, line))
+   {
+      size_t name = line.find("{\"name\": \"");
+      size_t ns = line.find("\"ns_per_op\": ");
+      if (std::string::npos == name || std::string::npos == ns) continue;
+      name += 10;
+      baseline[line.substr(name, line.find('"', name) - name)] = atof(line.c_str() + ns + 13);
+   }
+   return baseline;
+}
+
+inline bool parseOption(const char* argument, const char* option, std::string& value)
+{
+   size_t length = strlen(option);
+   if (strncmp(argument, option, length) || '=' != argument[length]) return false;
+   value = argument + length + 1;
+   return true;
+}
+
+/* context: extra "name": "value" pairs of the json header (cpu, simd, ...) */
+inline int runAll(int argc, char** argv, const std::map<std::string, std::string>& context = std::map<std::string, std::string>())
+{
+   Options options;
+   for (int i = 1; i < argc; ++i)
+   {
+      std::string value;
+      if (parseOption(argv[i], "--filter", value)) options.filter = value;
+      else if (parseOption(argv[i], "--min_time", value)) options.minTime = atof(value.c_str());
+      else if (parseOption(argv[i], "--repetitions", value)) options.repetitions = atoi(value.c_str());
+      else if (parseOption(argv[i], "--json", value)) options.json = value;
+      else if (parseOption(argv[i], "--baseline", value)) options.baseline = value;
+      else if (parseOption(argv[i], "--threshold", value)) options.threshold = atof(value.c_str());
+      else
+      {
+         std::cerr << "usage: " << argv[0] << " [--filter=text] [--min_time=seconds] [--repetitions=n] [--json=file]"
+                   << " [--baseline=file] [--threshold=percent]" << std::endl;
+         return 2;
+      }
+   }
+
+   std::vector<Result> results;
+   printf("%-56s %12s %12s %14s  %s\n", "benchmark", "ns/op", "min-max", "ops/s", "counters");
+   for (auto c : registry())
+   {
+      for (auto& args : c->argSets())
+      {
+         for (uint32_t threads : c->threadCounts())
+         {
+            if (!options.filter.empty() && std::string::npos == runName(*c, threads, args).find(options.filter)) continue;
+
+            Result result = run(*c, threads, args, options);
+            std::ostringstream counters;
+            for (auto& counter : result.counters) counters << counter.first << "=" << counter.second << " ";
+            char range[32];
+            snprintf(range, sizeof(range), "%.2f-%.2f", result.nsPerOpMin, result.nsPerOpMax);
+            printf("%-56s %12.2f %12s %14.0f  %s\n", result.name.c_str(), result.nsPerOp, range, result.opsPerSec,
+                   counters.str().c_str());
+            fflush(stdout);
+            results.push_back(result);
+         }
+      }
+   }
+
+   if (!options.json.empty())
+   {
+      std::ofstream out(options.json.c_str());
+      out << "{\n\"context\": {\"min_time\": " << options.minTime << ", \"repetitions\": " << options.repetitions
+          << ", \"hardware_concurrency\": " << std::thread::hardware_concurrency();
+      for (auto& entry : context) out << ", \"" << entry.first << "\": \"" << entry.second << "\"";
+      out << "},\n\"benchmarks\": [\n";
+      for (size_t i = 0; i < results.size(); ++i) out << jsonLine(results[i]) << (i + 1 < results.size() ? ",\n" : "\n");
+      out << "]\n}\n";
+   }
+
+   int status = 0;
+   if (!options.baseline.empty())
+   {
+      std::map<std::string, double> baseline = readBaseline(options.baseline);
+      for (auto& result : results)
+      {
+         std::map<std::string, double>::const_iterator it = baseline.find(result.name);
+         if (it == baseline.end() || it->second <= 0) continue;
+         double change = (result.nsPerOp - it->second) * 100 / it->second;
+         if (change > options.threshold)
+         {
+            printf("REGRESSION %s: %.2f ns/op, baseline %.2f (+%.1f%%)\n", result.name.c_str(), result.nsPerOp, it->second, change);
+            status = 1;
+         }
+      }
+      if (0 == status) printf("no regression over %.1f%% against %s\n", options.threshold, options.baseline.c_str());
+   }
+   return status;
+}
+
+} //namespace bench
+
+#endif /* _BENCHMARK_H */
@@ -61,6 +61,24 @@ void increment_tl (int id) {
         counter += tlcounter;
 }
 
+//increment single writer atomic, every thread owns its counter: relaxed load + store, no locked add
+struct alignas(64) SingleWriterCounter { std::atomic<unsigned int> value; };
+SingleWriterCounter swcounters[11];
+
+void increment_sw (int id) {
+
+        std::atomic<unsigned int>& swcounter = swcounters[id].value;
+        swcounter.store(0, std::memory_order_relaxed);
+        while (!ready) { 
+                std::this_thread::yield(); 
+        }// wait for the ready signal
+        
+        for(volatile int i=0; i<max_value; ++i){
+            swcounter.store(swcounter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+        counter += swcounter.load(std::memory_order_relaxed);
+}
+
 int func (std::function<void(int)> func )
 {
         ready = false;
@@ -88,6 +106,8 @@ int main ()
    func(f_func);
    std::cout << "Thread Local =========== " ;
    func(increment_tl);
+   std::cout << "Single Writer Atomic =========== " ;
+   func(increment_sw);
    std::cout << "Atomic =========== " ;
    func(increment_a);
    return 0;
@@ -0,0 +1,20 @@
+# benchmark suite: builds and runs bench_stats and bench_tls, results in bench_stats.json and bench_tls.json
+#   ./bench.sh                    run, write the json files
+#   ./bench.sh baseline_dir       also compare with baseline_dir/bench_*.json, exit 1 on a regression
+# extra flags (--filter=, --min_time=, --repetitions=, --threshold=) are read from BENCH_FLAGS
+cd "$(dirname "$0")"
+g++ bench_stats.cpp -std=c++11 -pthread -O2 -o bench_stats && g++ bench_tls.cpp -std=c++11 -pthread -O2 -o bench_tls
+if [ $? -ne 0 ]; then
+exit 1
+fi
+result=0
+for bench in bench_stats bench_tls
+do
+   baseline=""
+   if [ -n "$1" ]; then
+      cp "$1/$bench.json" "/tmp/$bench.baseline.json" || exit 1
+      baseline="--baseline=/tmp/$bench.baseline.json"
+   fi
+   ./$bench --json=$bench.json $baseline $BENCH_FLAGS || result=1
+done
+exit $result
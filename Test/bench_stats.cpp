@@ -0,0 +1,191 @@
+//compile g++ bench_stats.cpp -std=c++11 -pthread -O2 -o bench_stats
+
+/*
+ * Benchmarks of the atomic based counters (../stats.cpp): raw atomics by layout, GlobalStats and LabeledStats owned
+ * by the thread, StripedStats shared by all the threads, a thread_local baseline, the collector pass (fetch + merge)
+ * and the name registry lookups.
+ *    ./bench_stats --json=stats.json
+ *    ./bench_stats --baseline=stats.json          //exit 1 on a regression
+ */
+#define STATS_NO_MAIN
+#include "../stats.cpp"
+#include "Benchmark.h"
+
+/*
+ * heap bytes requested by the process, bytes per stat of the collector pass. The whole family is replaced (array
+ * and sized forms) and kept out of line, so the compiler never pairs the malloc() / free() inside them with a
+ * new / delete expression (-Wmismatched-new-delete)
+ */
+std::atomic<uint64_t> allocatedBytes(0);
+__attribute__((noinline)) void* operator new(size_t size)
+{
+   allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+   void* ptr = malloc(size ? size : 1);
+   if(nullptr == ptr) throw std::bad_alloc();
+   return ptr;
+}
+__attribute__((noinline)) void* operator new[](size_t size) { return operator new(size); }
+__attribute__((noinline)) void operator delete(void* ptr) noexcept { free(ptr); }
+__attribute__((noinline)) void operator delete[](void* ptr) noexcept { free(ptr); }
+__attribute__((noinline)) void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+__attribute__((noinline)) void operator delete[](void* ptr, size_t) noexcept { free(ptr); }
+
+/* every thread on the same cache line, one locked add per op */
+std::atomic<uint64_t> sharedAtomic(0);
+void benchAtomicShared(bench::State& state)
+{
+   while (state.keepRunning()) sharedAtomic.fetch_add(1, std::memory_order_relaxed);
+}
+
+/* a counter per thread, next to each other (false sharing) */
+std::atomic<uint64_t> packedAtomics[64];
+void benchAtomicPacked(bench::State& state)
+{
+   std::atomic<uint64_t>& counter = packedAtomics[state.threadIndex()];
+   while (state.keepRunning()) counter.fetch_add(1, std::memory_order_relaxed);
+}
+
+/* a counter per thread on its own cache line */
+struct alignas(CACHE_LINE_SIZE) PaddedAtomic { std::atomic<uint64_t> value; };
+PaddedAtomic paddedAtomics[64];
+void benchAtomicPadded(bench::State& state)
+{
+   std::atomic<uint64_t>& counter = paddedAtomics[state.threadIndex()].value;
+   while (state.keepRunning()) counter.fetch_add(1, std::memory_order_relaxed);
+}
+
+/* single writer GlobalStats owned by the thread, keys counters updated round robin */
+void benchGlobalStats(bench::State& state)
+{
+   uint64_t keys = state.arg("keys");
+   std::vector<std::unique_ptr<CacheAligned<GlobalStats> > > stats;
+   for (uint64_t i = 0; i < keys; ++i) stats.push_back(std::unique_ptr<CacheAligned<GlobalStats> >(new CacheAligned<GlobalStats>(i)));
+   uint64_t mask = keys - 1;
+   uint64_t i = 0;
+   while (state.keepRunning()) (*stats[i++ & mask])->inc();
+}
+
+/* request scoped counter: registration, one update, retirement of its final value */
+void benchCreateDestroy(bench::State& state)
+{
+   while (state.keepRunning())
+   {
+      GlobalStats request(55);
+      request.inc();
+   }
+   if (0 == state.threadIndex()) StatsMap::getInstance().clear(); //the retired values, no collector in the benchmark
+}
+
+/* one StripedStats, every thread updates it */
+StripedStats stripedShared(1);
+void benchStripedShared(bench::State& state)
+{
+   while (state.keepRunning()) stripedShared.inc();
+}
+
+/* baseline: a plain thread_local increment */
+void benchThreadLocal(bench::State& state)
+{
+   static thread_local uint64_t counter = 0;
+   while (state.keepRunning())
+   {
+      ++counter;
+      bench::doNotOptimize(counter);
+   }
+}
+
+/* one collector pass (fetch + merge) over stats changed CollectionStats of 100 stat ids */
+void benchCollectorPass(bench::State& state)
+{
+   uint64_t count = state.arg("stats");
+   StatsMap::getInstance().clear(); //final values of the counters of the previous runs
+   uint64_t before = allocatedBytes.load();
+   std::vector<std::unique_ptr<CollectionStats> > stats;
+   stats.reserve(count);
+   for (uint64_t i = 0; i < count; ++i) stats.push_back(std::unique_ptr<CollectionStats>(new CollectionStats(i % 100, i / 100)));
+   StatsSnapshot snapshot(count);
+   StatsAggregator aggregator;
+   for (auto& stat : stats) stat->inc();
+   FETCH_STATS_OBJ(snapshot);
+   aggregator.merge(snapshot);
+   state.setCounter("bytes_per_stat", static_cast<double>(allocatedBytes.load() - before) / count);
+   while (state.keepRunning())
+   {
+      state.pauseTiming();
+      for (auto& stat : stats) stat->inc();
+      state.resumeTiming();
+      FETCH_STATS_OBJ(snapshot);
+      aggregator.merge(snapshot);
+   }
+}
+
+/* LabeledStats owned by the thread, series ids resolved once (the call site cache), updated round robin */
+void benchLabeled(bench::State& state)
+{
+   static LabelSet labels(40, {"series"}, 100000);
+   uint64_t count = state.arg("series");
+   std::vector<uint32_t> series;
+   for (uint64_t i = 0; i < count; ++i) series.push_back(labels.series({std::to_string(i)}));
+   LabeledStats stats(labels);
+   uint64_t mask = count - 1;
+   uint64_t i = 0;
+   while (state.keepRunning()) stats.inc(series[i++ & mask]);
+}
+
+/* names svc<n>.rpc.host<n>.requests interned once, the registry only grows */
+StatsNames& benchNames(uint64_t count)
+{
+   static StatsNames names;
+   for (uint64_t i = names.size(); i < count; ++i)
+   {
+      names.intern("svc" + std::to_string(i / 1000) + ".rpc.host" + std::to_string(i % 1000) + ".requests");
+   }
+   return names;
+}
+
+/* name -> id lookup, the collector / exporter side of the interned names */
+void benchNamesFind(bench::State& state)
+{
+   uint64_t count = state.arg("names");
+   StatsNames& names = benchNames(count);
+   std::vector<std::string> keys;
+   for (uint64_t i = 0; i < 1024; ++i) keys.push_back(names.name((i * 7919) % count));
+   uint64_t i = 0;
+   uint32_t id = 0;
+   while (state.keepRunning())
+   {
+      id = names.find(keys[i++ & 1023]);
+      bench::doNotOptimize(id);
+   }
+   state.setCounter("bytes_per_name", static_cast<double>(names.memory()) / names.size());
+}
+
+/* every name of one svc<n>. prefix (1000 names) */
+void benchNamesPrefix(bench::State& state)
+{
+   StatsNames& names = benchNames(state.arg("names"));
+   uint64_t matched = 0;
+   while (state.keepRunning()) names.forEachPrefix("svc1.", [&matched](uint32_t, const char*) { ++matched; });
+   bench::doNotOptimize(matched);
+}
+
+BENCHMARK_CASE(benchAtomicShared, "atomic/shared").threads({1, 2, 4, 8});
+BENCHMARK_CASE(benchAtomicPacked, "atomic/packed").threads({1, 2, 4, 8});
+BENCHMARK_CASE(benchAtomicPadded, "atomic/padded").threads({1, 2, 4, 8});
+BENCHMARK_CASE(benchGlobalStats, "global_stats/inc").threads({1, 4}).arg("keys", {1, 64, 4096});
+BENCHMARK_CASE(benchCreateDestroy, "global_stats/create_destroy").threads({1, 4});
+BENCHMARK_CASE(benchLabeled, "labeled_stats/inc").threads({1, 4}).arg("series", {64, 4096});
+BENCHMARK_CASE(benchStripedShared, "striped_stats/shared").threads({1, 2, 4, 8});
+BENCHMARK_CASE(benchThreadLocal, "thread_local/raw").threads({1, 4});
+BENCHMARK_CASE(benchCollectorPass, "collector/pass").arg("stats", {1000, 10000, 100000});
+BENCHMARK_CASE(benchNamesFind, "names/find").arg("names", {1000, 1000000});
+BENCHMARK_CASE(benchNamesPrefix, "names/prefix").arg("names", {1000000});
+
+int main(int argc, char** argv)
+{
+   std::map<std::string, std::string> context;
+   context["variant"] = "atomic";
+   context["compiler"] = __VERSION__;
+   context["simd"] = SimdKernels::name(SimdKernels::best());
+   return bench::runAll(argc, argv, context);
+}
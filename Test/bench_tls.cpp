@@ -0,0 +1,178 @@
+//compile g++ bench_tls.cpp -std=c++11 -pthread -O2 -o bench_tls
+
+/*
+ * Benchmarks of the thread local stats maps (../TLS/stats.cpp): i_increment by key cardinality and access pattern,
+ * StatBatch, i_increment_many, compile time stats, a thread_local baseline and the collector pass (aggregate()).
+ *    ./bench_tls --json=tls.json
+ *    ./bench_tls --baseline=tls.json              //exit 1 on a regression
+ */
+#define STATS_NO_MAIN
+#define STATS_QUIET
+#include "../TLS/stats.cpp"
+#include "Benchmark.h"
+
+/* sequential (0, 1, 2 ..) or shuffled key order over keys stat ids, same ids in every thread */
+std::vector<uint64_t> keyOrder(uint64_t keys, bool shuffled)
+{
+   std::vector<uint64_t> order(keys);
+   for (uint64_t i = 0; i < keys; ++i) order[i] = i;
+   uint64_t seed = 0x9E3779B97F4A7C15ULL;
+   for (uint64_t i = keys; shuffled && i > 1; --i)
+   {
+      seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      std::swap(order[i - 1], order[(seed >> 33) % i]);
+   }
+   return order;
+}
+
+/* drops the maps of the exited benchmark threads, the list would otherwise grow run after run */
+void retireMaps(bench::State& state)
+{
+   if (0 == state.threadIndex()) ThreadStatsMapContainer::getInstance().aggregate();
+}
+
+void benchIncrement(bench::State& state)
+{
+   std::vector<uint64_t> order = keyOrder(state.arg("keys"), state.arg("shuffled"));
+   for (uint64_t key : order) ThreadStatsMapContainer::i_increment(key, 1); //inserts, not timed
+   uint64_t mask = order.size() - 1;
+   uint64_t i = 0;
+   while (state.keepRunning()) ThreadStatsMapContainer::i_increment(order[i++ & mask], 1);
+   state.setCounter("bytes_per_stat", static_cast<double>(ThreadStatsMapContainer::getStatsCtxt().getStatsMap().memory())
+                    / order.size());
+   retireMaps(state);
+}
+
+void benchStatBatch(bench::State& state)
+{
+   StatBatch batch(1);
+   while (state.keepRunning()) batch.inc();
+   batch.flush();
+   retireMaps(state);
+}
+
+void benchIncrementMany(bench::State& state)
+{
+   const size_t BURST = 64;
+   uint64_t keys[BURST], vals[BURST];
+   for (size_t i = 0; i < BURST; ++i)
+   {
+      keys[i] = i;
+      vals[i] = 1;
+   }
+   ThreadStatsMapContainer::i_increment_many(keys, vals, BURST);
+   while (state.keepRunning()) ThreadStatsMapContainer::i_increment_many(keys, vals, BURST);
+   state.setCounter("keys_per_op", BURST);
+   retireMaps(state);
+}
+
+void benchStaticStat(bench::State& state)
+{
+   while (state.keepRunning()) ThreadStatsMapContainer::s_increment<StaticStat::BENCH_STAT_0>(1);
+   retireMaps(state);
+}
+
+/* baseline: a plain thread_local increment */
+void benchThreadLocal(bench::State& state)
+{
+   static thread_local uint64_t counter = 0;
+   while (state.keepRunning())
+   {
+      ++counter;
+      bench::doNotOptimize(counter);
+   }
+}
+
+/* helper threads owning stats maps, every round they change all their keys */
+struct MapOwners
+{
+   MapOwners(uint32_t threads, uint64_t keys) : _keys(keys), _round(0), _done(0), _exit(false), _memory(0)
+   {
+      for (uint32_t i = 0; i < threads; ++i) _threads.push_back(std::thread(&MapOwners::own, this));
+      bump();
+   }
+   ~MapOwners()
+   {
+      {
+         std::lock_guard<std::mutex> lck (_mtx);
+         _exit = true;
+      }
+      _cv.notify_all();
+      for (auto& thread : _threads) thread.join();
+   }
+   /* returns once every owner changed all its keys */
+   void bump()
+   {
+      std::unique_lock<std::mutex> lck (_mtx);
+      _done = 0;
+      ++_round;
+      _cv.notify_all();
+      _cv.wait(lck, [this]() { return _done == _threads.size(); });
+   }
+   uint64_t memory() const { return _memory.load(); }
+private:
+   void own()
+   {
+      uint32_t seen = 0;
+      std::unique_lock<std::mutex> lck (_mtx);
+      while (true)
+      {
+         _cv.wait(lck, [&]() { return _exit || _round != seen; });
+         if (_exit) return;
+         seen = _round;
+         lck.unlock();
+         for (uint64_t key = 0; key < _keys; ++key) ThreadStatsMapContainer::i_increment(key, 1);
+         if (1 == seen) _memory += ThreadStatsMapContainer::getStatsCtxt().getStatsMap().memory();
+         lck.lock();
+         ++_done;
+         _cv.notify_all();
+      }
+   }
+   uint64_t _keys;
+   std::vector<std::thread> _threads;
+   std::mutex _mtx;
+   std::condition_variable _cv;
+   uint32_t _round;
+   uint32_t _done;
+   bool _exit;
+   std::atomic<uint64_t> _memory;
+};
+
+/* one aggregate() after owners threads changed all their keys */
+void benchCollectorPass(bench::State& state)
+{
+   ThreadStatsMapContainer& container = ThreadStatsMapContainer::getInstance();
+   uint64_t keys = state.arg("keys");
+   uint32_t owners = state.arg("owners");
+   container.setAggregateWorkers(state.arg("workers"));
+   {
+      MapOwners maps(owners, keys);
+      state.setCounter("bytes_per_stat", static_cast<double>(maps.memory()) / (owners * keys));
+      container.aggregate();
+      while (state.keepRunning())
+      {
+         state.pauseTiming();
+         maps.bump();
+         state.resumeTiming();
+         StatsMap stats = container.aggregate();
+      }
+   }
+   container.setAggregateWorkers(0);
+   container.aggregate();
+}
+
+BENCHMARK_CASE(benchIncrement, "tls/i_increment").threads({1, 4}).arg("keys", {1, 64, 4096, 65536}).arg("shuffled", {0, 1});
+BENCHMARK_CASE(benchStatBatch, "tls/stat_batch").threads({1, 4});
+BENCHMARK_CASE(benchIncrementMany, "tls/i_increment_many").threads({1, 4});
+BENCHMARK_CASE(benchStaticStat, "tls/s_increment").threads({1, 4});
+BENCHMARK_CASE(benchThreadLocal, "thread_local/raw").threads({1, 4});
+BENCHMARK_CASE(benchCollectorPass, "tls/collector_pass").arg("owners", {1, 8, 64}).arg("keys", {1000}).arg("workers", {0, 4});
+
+int main(int argc, char** argv)
+{
+   std::map<std::string, std::string> context;
+   context["variant"] = "tls";
+   context["compiler"] = __VERSION__;
+   context["simd"] = SimdKernels::name(SimdKernels::best());
+   return bench::runAll(argc, argv, context);
+}
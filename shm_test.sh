@@ -0,0 +1,14 @@
+# shared memory segment test: writers at full rate, statsreader checks every snapshot from another process
+g++ stats.cpp -std=c++11 -pthread -O2 -DSHM_TEST -o shmtest && g++ statsreader.cpp -std=c++11 -O2 -o statsreader
+if [ $? -ne 0 ]; then
+exit 1
+fi
+rm -f /dev/shm/localstats_test
+./shmtest &
+writer=$!
+./statsreader -c -t 3 /dev/shm/localstats_test
+result=$?
+wait $writer || result=1
+./statsreader -n 1 /dev/shm/localstats_test | head -5
+rm -f /dev/shm/localstats_test
+exit $result
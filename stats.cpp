@@ -5,10 +5,25 @@
 #include <atomic>         // std::atomic
 #include <thread>         // std::thread
 #include <vector>         // std::vector
-#include <unordered_set>
 #include <mutex>
 #include <map>
 #include <chrono>
+#include <new>
+#include <algorithm>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <string>
+#include <stdexcept>
+#include <stdlib.h>
+#include <sched.h>
+#include "Histogram.h"
+#include "SimdKernels.h"
+#include "StatsExporter.h"
+#include "StatsShm.h"
+#include "StatsHistory.h"
+#include "StatsCollector.h"
+#include "StatsNames.h"
 
 
 /* define  LOCAL_ATOMIC to 1 if you want to test distributed local stats */
@@ -31,94 +46,288 @@ class Singleton: public NCA
 
 };
 
-enum class StatType
+static constexpr size_t CACHE_LINE_SIZE = 64;
+
+/*
+ * CacheAligned<Counter> gives a counter its own cache line(s). Counters of different threads that are
+ * allocated next to each other (arrays, members of one struct) otherwise share a line and every increment
+ * of one thread invalidates the line of the other (false sharing).
+ *    CacheAligned<GlobalStats> rxStats(RX_STAT_ID);  rxStats->inc();
+ */
+template <typename T>
+class alignas(CACHE_LINE_SIZE) CacheAligned
+{
+  public:
+     template <typename... Args>
+     explicit CacheAligned(Args&&... args) : _counter(std::forward<Args>(args)...) {}
+     T* operator->() { return &_counter; }
+     T& get() { return _counter; }
+     /* plain new does not honour alignas before c++17 */
+     static void* operator new(size_t size)
+     {
+        void* ptr = nullptr;
+        if (::posix_memalign(&ptr, CACHE_LINE_SIZE, size) != 0) throw std::bad_alloc();
+        return ptr;
+     }
+     static void operator delete(void* ptr) { ::free(ptr); }
+  private:
+     T _counter;
+};
+
+enum class StatType : uint8_t
 {
   GLOBAL_STATS = 1, /* global stat id, similar to uint32_t globalStat */
-  ARRAY_OF_STATS  = 2 /* collection of same stat id with different identifier, like std::vector< {id, counter} > */
+  ARRAY_OF_STATS  = 2, /* collection of same stat id with different identifier, like std::vector< {id, counter} > */
+  HISTOGRAM = 3 /* distribution of recorded values (latency), log linear buckets */
+};
+
+/* one collected value: what changed for (statId, collectionId) since the previous collection */
+struct StatRecord
+{
+  uint32_t statId;
+  uint32_t collectionId;
+  uint64_t value;
+  StatType type;
+  uint32_t bucket; //< HISTOGRAM only, LogLinearBuckets index, value is the number of samples
+};
+
+/*
+ * RetiredStats - fixed size table of the final deltas of destroyed counters, summed by (statId, collectionId,
+ * bucket): a thousand request scoped counters of one stat are one record for the collector. Never allocates,
+ * add() fails once it holds MAX_KEYS keys. Not thread safe, StatsMap keeps one per shard under the shard lock.
+ */
+class RetiredStats : public NCA
+{
+  public:
+     static const uint32_t CAPACITY = 256;
+     static const uint32_t MAX_KEYS = CAPACITY * 3 / 4;
+
+     RetiredStats() : _count(0)
+     {
+        for (auto& record : _records) record.type = EMPTY;
+     }
+     /* false when full */
+     bool add(const StatRecord& record)
+     {
+        uint32_t idx = ((record.statId * 0x9E3779B1u) ^ (record.collectionId * 0x85EBCA6Bu) ^ record.bucket) % CAPACITY;
+        for (; EMPTY != _records[idx].type; idx = (idx + 1) % CAPACITY)
+        {
+           StatRecord& current = _records[idx];
+           if (current.statId == record.statId && current.collectionId == record.collectionId
+               && current.bucket == record.bucket && current.type == record.type)
+           {
+              current.value += record.value;
+              return true;
+           }
+        }
+        if (_count == MAX_KEYS) return false;
+        _records[idx] = record;
+        _used[_count++] = idx;
+        return true;
+     }
+     /* f(record) for every key, then empty, touches only the used slots */
+     template <typename F>
+     void drain(F f)
+     {
+        for (uint32_t i = 0; i < _count; ++i)
+        {
+           StatRecord& record = _records[_used[i]];
+           f(record);
+           record.type = EMPTY;
+        }
+        _count = 0;
+     }
+     uint32_t size() const { return _count; }
+  private:
+     static constexpr StatType EMPTY = static_cast<StatType>(0);
+     StatRecord _records[CAPACITY];
+     uint16_t _used[MAX_KEYS]; //< slots in use, in insertion order
+     uint32_t _count;
+};
+
+/*
+ * StatsSnapshot is the reusable buffer the collector hands to StatsMap::fetch(). It keeps its capacity
+ * between cycles, so once it has grown to the number of live counters a collection cycle does not allocate.
+ * With a RetiredStats the records are summed in it, only the ones that do not fit are kept (StatsMap::del()).
+ */
+class StatsSnapshot : public NCA
+{
+  public:
+     StatsSnapshot(size_t capacity = 1024) : _retired(nullptr) { _records.reserve(capacity); }
+     explicit StatsSnapshot(RetiredStats* retired) : _retired(retired) {}
+     void add(uint32_t statId, uint32_t collectionId, uint64_t value, StatType type, uint32_t bucket = 0)
+     {
+        StatRecord record = { statId, collectionId, value, type, bucket };
+        if (_retired && _retired->add(record)) return;
+        _records.push_back(record);
+     }
+     void add(const StatRecord& record) { _records.push_back(record); }
+     void append(const StatsSnapshot& other) { _records.insert(_records.end(), other.begin(), other.end()); }
+     void clear() { _records.clear(); }
+     size_t size() const { return _records.size(); }
+     size_t capacity() const { return _records.capacity(); }
+     std::vector<StatRecord>::const_iterator begin() const { return _records.begin(); }
+     std::vector<StatRecord>::const_iterator end() const { return _records.end(); }
+  private:
+     RetiredStats* _retired;
+     std::vector<StatRecord> _records;
 };
 
 /* all the stats counters must implement from BaseCounter */
+/*
+ * A counter is updated only by the thread owning it (it lives in that thread stack), so inc/dec are a relaxed
+ * load + store and compile to a plain add. The collector never resets the counter, it keeps the last value it
+ * has seen (_lastSeen, only touched under the StatsMap lock) and collects the delta.
+ */
 class BaseCounter: public NCA
 {
   protected:
-     BaseCounter( uint32_t statId, StatType type, bool addToStats)
-      : _value(0), _statId(statId), _type(type)
-        ,_addToStatsContainer(addToStats) {}
+     BaseCounter( uint32_t statId, StatType type, uint32_t collectionId, bool addToStats)
+      : _value(0), _lastSeen(0), _statId(statId), _collectionId(collectionId), _type(type)
+        ,_addToStatsContainer(addToStats), _shard(0), _slot(0) {}
   public:
      BaseCounter( uint32_t statId, StatType type)
-      : _value(0), _statId(statId), _type(type)
-        ,_addToStatsContainer(true) {}
+      : _value(0), _lastSeen(0), _statId(statId), _collectionId(0), _type(type)
+        ,_addToStatsContainer(true), _shard(0), _slot(0) {}
      virtual ~BaseCounter(){}; 
-     void inc(uint64_t val = 1) { _value+= val ;}
-     void dec(uint64_t val = 1) { _value-= val ;}
-     uint64_t reset() { return _value.exchange(0); }
+     void inc(uint64_t val = 1) { _value.store(getStatValue() + val, std::memory_order_relaxed); }
+     void dec(uint64_t val = 1) { _value.store(getStatValue() - val, std::memory_order_relaxed); }
      uint64_t getStatValue() { return _value.load(std::memory_order_relaxed); }
      uint32_t getStatId() { return _statId; }
+     uint32_t getCollectionId() { return _collectionId; }
      StatType getStatType() { return _type; }
-     //duplicate and reset values, should not use by user
-     BaseCounter* duplicate()
+     //record what changed since the previous collection, nothing if unchanged, should not use by user
+     virtual void collect(StatsSnapshot& snapshot)
      { 
-           BaseCounter* tmp = createObj(); 
-           copyAndResetStats(*tmp);
-           return tmp; 
+       uint64_t value = getStatValue();
+       if (value == _lastSeen) return; //idle counters cost one load, the snapshot only holds what moved
+       snapshot.add(_statId, _collectionId, value - _lastSeen, _type);
+       _lastSeen = value;
      }
      bool addStatsObject() { return _addToStatsContainer;}
-   protected:
-     //all Derived class must call this function 
-     virtual BaseCounter* createObj() = 0;
-     void copyAndResetStats(BaseCounter& tmp)  
-     { 
-       tmp.inc(reset());
-     }
    protected:
      std::atomic<uint64_t> _value;
+     uint64_t _lastSeen; //< collector side
      uint32_t _statId;
+     uint32_t _collectionId; //< 0 for GLOBAL_STATS
      StatType _type;
      bool _addToStatsContainer;
+   private:
+     friend class StatsMap;
+     uint8_t _shard; //< registration in the StatsMap, in the padding after the hot fields: a counter stays 40 bytes
+     uint32_t _slot; //< index in the shard array, under the shard lock
 };
 
 /* StatsMap is a singleton globals  stats structure used by collector to collect and local variables to register */
+/*
+ * Counters are kept in an array of pointers per shard, each shard with its own lock. A thread registers its
+ * counters in its own shard (round robin at the thread first counter), so add / del take a lock only the collector
+ * competes for, once per pass, and never hash. The counter only keeps its shard and slot (swap with the last one
+ * on del), no list links: it stays 40 bytes, packed counters of different threads share fewer cache lines
+ * (FALSE_SHARING_TEST). add() allocates only when a shard array grows past its largest size so far, the capacity is
+ * kept for the next counters. del() removes the counter and sums its final
+ * deltas in the RetiredStats of the shard, the collector takes them with the live counters of the shard in the
+ * next fetch(). Keys that do not fit in a full RetiredStats are kept under _overflowMtx, nothing is lost.
+ * Every shard also counts its counters and the time add() / del() waited for a contended shard lock (read in
+ * fetch(), usage() is what the last one cost, see SelfStats).
+ */
 class StatsMap : public Singleton
 {
    public:
-      StatsMap(){_statsValue.reserve(1000);}
+      static const uint32_t SHARDS = 64;
+
+      /* what the last fetch() cost and what changed since the previous one, collector thread */
+      struct Usage
+      {
+        uint64_t fetchNs;
+        uint64_t collectWaitNs; //< fetch() waiting for the shard locks, it holds them the rest of fetchNs
+        uint64_t lockWaitNs;    //< add() / del() waiting for their shard lock since the previous fetch()
+        uint64_t counters;      //< registered counters
+        uint64_t created;       //< counters registered since the previous fetch()
+        uint64_t allocations;   //< snapshot / overflow buffer growths since the previous fetch()
+        uint64_t bytes;         //< shards with their counter arrays, snapshot and overflow buffers
+      };
+
+      StatsMap() : _retired(static_cast<size_t>(0)), _overflowAllocations(0), _nextShard(0), _usage() {}
       __attribute__((noinline)) void add(BaseCounter* stat) 
       { 
         if(false == stat->addStatsObject()) return;
         //std::cout<<"adding***"<<std::endl;
-        std::lock_guard<std::mutex> lck (_mtx); _statsPtr.insert(stat); 
+        static thread_local uint32_t shard = _nextShard.fetch_add(1, std::memory_order_relaxed) % SHARDS;
+        stat->_shard = shard;
+        Shard& owner = _shards[shard];
+        uint64_t waitNs = lockTimed(owner.mtx);
+        std::lock_guard<std::mutex> lck (owner.mtx, std::adopt_lock);
+        if (waitNs) owner.waitNs += waitNs;
+        ++owner.created;
+        stat->_slot = owner.stats.size();
+        owner.stats.push_back(stat);
       }
       __attribute__((noinline)) void del(BaseCounter* stat) 
       {
         if(false == stat->addStatsObject()) return;
         //std::cout<<"deleting***"<<std::endl;
-        BaseCounter* base = stat->duplicate(); 
-        std::lock_guard<std::mutex> lck (_mtx);  
-        _statsValue.push_back(base); 
-        _statsPtr.erase(stat); 
+        Shard& owner = _shards[stat->_shard];
+        StatsSnapshot retired(&owner.retired); //no buffer, only the records a full RetiredStats rejects
+        {
+          uint64_t waitNs = lockTimed(owner.mtx);
+          std::lock_guard<std::mutex> lck (owner.mtx, std::adopt_lock);
+          if (waitNs) owner.waitNs += waitNs;
+          BaseCounter* last = owner.stats.back();
+          owner.stats[stat->_slot] = last;
+          last->_slot = stat->_slot;
+          owner.stats.pop_back();
+          stat->collect(retired); //under the shard lock, fetch() may be collecting the shard
+        }
+        if (retired.size())
+        {
+          std::lock_guard<std::mutex> lck (_overflowMtx);
+          size_t capacity = _retired.capacity();
+          _retired.append(retired);
+          if (capacity != _retired.capacity()) ++_overflowAllocations;
+        }
       }
-      __attribute__((noinline)) std::vector<BaseCounter*> fetch()
+      /* fills snapshot with the deleted counters final values and the changes of the live ones */
+      __attribute__((noinline)) void fetch(StatsSnapshot& snapshot)
       {
-        std::vector<BaseCounter*>  tmp;
-        tmp.reserve(_statsValue.size() + _statsPtr.size() + 10);
-        std::lock_guard<std::mutex> lck (_mtx);
-        //std::cout<<"size deleted obj: "<< _statsValue.size() << " total stats: "<<_statsPtr.size()<<std::endl;
-        for(auto& deleted : _statsValue)
-           tmp.push_back(deleted);
-           _statsValue.clear(); 
-        for(auto val : _statsPtr)
-           tmp.push_back(val->duplicate());
-        return tmp; 
+        auto begin = std::chrono::steady_clock::now();
+        size_t capacity = snapshot.capacity();
+        Usage usage = Usage();
+        snapshot.clear();
+        for (auto& shard : _shards)
+        {
+          usage.collectWaitNs += lockTimed(shard.mtx);
+          std::lock_guard<std::mutex> lck (shard.mtx, std::adopt_lock);
+          usage.lockWaitNs += shard.waitNs;
+          usage.counters += shard.stats.size();
+          usage.bytes += shard.stats.capacity() * sizeof(BaseCounter*);
+          usage.created += shard.created;
+          shard.waitNs = 0;
+          shard.created = 0;
+          shard.retired.drain([&snapshot](const StatRecord& record) { snapshot.add(record); });
+          for (BaseCounter* stat : shard.stats) stat->collect(snapshot);
+        }
+        usage.collectWaitNs += lockTimed(_overflowMtx);
+        std::lock_guard<std::mutex> lck (_overflowMtx, std::adopt_lock);
+        //std::cout<<"size deleted obj: "<< _retired.size() <<std::endl;
+        snapshot.append(_retired);
+        _retired.clear(); 
+        usage.allocations = _overflowAllocations + (capacity != snapshot.capacity() ? 1 : 0);
+        _overflowAllocations = 0;
+        usage.bytes += sizeof(_shards) + (snapshot.capacity() + _retired.capacity()) * sizeof(StatRecord);
+        usage.fetchNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+        _usage = usage;
       }
+      const Usage& usage() const { return _usage; }
       void clear()
       {
-         //std::cout<<"clearing all stats";
-         for(auto it = std::begin(_statsValue); it != std::end(_statsValue); ++it)
+         for (auto& shard : _shards)
          {
-           delete *it;
+           std::lock_guard<std::mutex> lck (shard.mtx);
+           shard.retired.drain([](const StatRecord&) {});
          }
-         _statsValue.clear(); 
-         //std::cout<<"done clearing all stats";
+         std::lock_guard<std::mutex> lck (_overflowMtx);
+         _retired.clear(); 
       }
       static StatsMap& getInstance()
       {
@@ -131,9 +340,21 @@ class StatsMap : public Singleton
       }
 
     protected:
-      std::vector<BaseCounter*> _statsValue;
-      std::unordered_set<BaseCounter*> _statsPtr;
-      std::mutex _mtx;
+      struct alignas(CACHE_LINE_SIZE) Shard
+      {
+        Shard() : created(0), waitNs(0) {}
+        std::mutex mtx;
+        std::vector<BaseCounter*> stats; //< registered in the shard, on the cache line of mtx
+        uint64_t created;     //< since the previous fetch
+        uint64_t waitNs;      //< add() / del() waits on mtx since the previous fetch, written on contention only
+        RetiredStats retired; //< final values of deleted counters, waiting for the next fetch
+      };
+      Shard _shards[SHARDS];
+      StatsSnapshot _retired;     //< records of deleted counters a full RetiredStats did not take, under _overflowMtx
+      std::mutex _overflowMtx;
+      uint64_t _overflowAllocations; //< _retired growths, under _overflowMtx
+      std::atomic<uint32_t> _nextShard;
+      Usage _usage;               //< of the last fetch(), collector thread
 };
 
 #define ADD_STATS_OBJ(obj) \
@@ -142,8 +363,8 @@ class StatsMap : public Singleton
 #define DEL_STATS_OBJ(obj) \
    StatsMap::getInstance().del(obj);
 
-#define FETCH_STATS_OBJ() \
-   StatsMap::getInstance().fetch();
+#define FETCH_STATS_OBJ(snapshot) \
+   StatsMap::getInstance().fetch(snapshot);
 
 
 
@@ -160,14 +381,6 @@ public:
      { 
        DEL_STATS_OBJ(this); //call only from concrete class 
      }
-private:     
-     GlobalStats( uint32_t statId, bool addToStats): BaseCounter(statId, StatType::GLOBAL_STATS, false) 
-     {
-     }
-     virtual GlobalStats* createObj() 
-     { 
-           return new GlobalStats(_statId, false); //call only from concrete class 
-     }
 };
 
 /* concreate class */
@@ -176,8 +389,7 @@ class CollectionStats final: public BaseCounter
  
 public:
      CollectionStats( uint32_t statId, uint32_t collectionId)
-      : BaseCounter(statId, StatType::ARRAY_OF_STATS)
-      , _collectionId(collectionId)   
+      : BaseCounter(statId, StatType::ARRAY_OF_STATS, collectionId, true)
      {
        ADD_STATS_OBJ(this); //call only from concrete class   
      }
@@ -185,67 +397,677 @@ public:
      { 
        DEL_STATS_OBJ(this); //call only from concrete class 
      } 
-private:     
-     CollectionStats( uint32_t statId, uint32_t collectionId, bool addToStats)
-      : BaseCounter(statId, StatType::ARRAY_OF_STATS, false)
-      , _collectionId(collectionId)  
-     {} 
-     virtual CollectionStats* createObj() 
+};
+
+/* concreate class, latency histogram. The counter value is the number of recorded samples */
+class HistogramStats final: public BaseCounter
+{
+ 
+public:
+     HistogramStats( uint32_t statId, uint32_t collectionId = 0)
+      : BaseCounter(statId, StatType::HISTOGRAM, collectionId, true)
+     {
+       for (uint32_t i = 0; i < LogLinearBuckets::COUNT; ++i)
+       {
+         _buckets[i].store(0, std::memory_order_relaxed);
+         _bucketsSeen[i] = 0;
+       }
+       ADD_STATS_OBJ(this); //call only from concrete class   
+     }
+     virtual ~HistogramStats() 
+     { 
+       DEL_STATS_OBJ(this); //call only from concrete class 
+     } 
+     /* single writer like every counter: bucket lookup + relaxed load/store, no atomic RMW */
+     void record(uint64_t value)
+     {
+       std::atomic<uint64_t>& bucket = _buckets[LogLinearBuckets::index(value)];
+       bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+       std::atomic_thread_fence(std::memory_order_release); //a collector seeing the count sees the bucket
+       inc();
+     }
+     //one record per bucket that changed since the previous collection, the bucket deltas are one vector pass
+     //over a relaxed copy of the buckets; an idle histogram (sample count unchanged) stops at the count load
+     virtual void collect(StatsSnapshot& snapshot)
+     {
+       uint64_t value = getStatValue();
+       if (value == _lastSeen) return;
+       std::atomic_thread_fence(std::memory_order_acquire);
+       uint64_t current[LogLinearBuckets::COUNT], deltas[LogLinearBuckets::COUNT];
+       SimdKernels::load(current, _buckets, LogLinearBuckets::COUNT);
+       if (SimdKernels::delta(deltas, current, _bucketsSeen, LogLinearBuckets::COUNT))
+       {
+         for (uint32_t i = 0; i < LogLinearBuckets::COUNT; ++i)
+         {
+           if (deltas[i]) snapshot.add(_statId, _collectionId, deltas[i], _type, i);
+         }
+       }
+       _lastSeen = value;
+     }
+private:
+     std::atomic<uint64_t> _buckets[LogLinearBuckets::COUNT];
+     uint64_t _bucketsSeen[LogLinearBuckets::COUNT]; //< collector side
+};
+
+/*
+ * concreate class, striped counter for call sites that can not own a counter (short lived threads, callbacks).
+ * Any thread may update it: the value is split in cache line padded shards, an update is a relaxed fetch_add on
+ * the shard of the current cpu (sched_getcpu, a thread id hash when it is not available), so threads running on
+ * different cpus rarely share a line. The collector sums the shards.
+ *    StripedStats rxStats(RX_STAT_ID);   //global or static
+ *    rxStats.inc();                      //from any thread
+ */
+class StripedStats final: public BaseCounter
+{
+ 
+public:
+     /* shards: 0 = one per cpu, rounded up to a power of two */
+     StripedStats( uint32_t statId, uint32_t collectionId = 0, uint32_t shards = 0)
+      : BaseCounter(statId, collectionId ? StatType::ARRAY_OF_STATS : StatType::GLOBAL_STATS, collectionId, true)
+        ,_shards(nullptr), _mask(0)
+     {
+       uint32_t count = shards ? shards : std::max(1u, std::thread::hardware_concurrency());
+       uint32_t size = 1;
+       while (size < count) size <<= 1;
+       void* ptr = nullptr;
+       if (::posix_memalign(&ptr, CACHE_LINE_SIZE, size * sizeof(Shard)) != 0) throw std::bad_alloc();
+       _shards = static_cast<Shard*>(ptr);
+       for (uint32_t i = 0; i < size; ++i) ::new (&_shards[i]) Shard();
+       _mask = size - 1;
+       ADD_STATS_OBJ(this); //call only from concrete class   
+     }
+     virtual ~StripedStats() 
      { 
-           return new CollectionStats(_statId, _collectionId, false); //call only from concrete class 
+       DEL_STATS_OBJ(this); //call only from concrete class 
+       ::free(_shards);
+     } 
+     /* multi writer, hides BaseCounter::inc/dec */
+     void inc(uint64_t val = 1) { _shards[shard()].value.fetch_add(val, std::memory_order_relaxed); }
+     void dec(uint64_t val = 1) { _shards[shard()].value.fetch_sub(val, std::memory_order_relaxed); }
+     uint64_t getStatValue()
+     {
+       uint64_t value = 0;
+       for (uint32_t i = 0; i <= _mask; ++i) value += _shards[i].value.load(std::memory_order_relaxed);
+       return value;
+     }
+     uint32_t shards() const { return _mask + 1; }
+     virtual void collect(StatsSnapshot& snapshot)
+     {
+       uint64_t value = getStatValue();
+       if (value == _lastSeen) return;
+       snapshot.add(_statId, _collectionId, value - _lastSeen, _type);
+       _lastSeen = value;
      }
 private:
-     uint32_t _collectionId;    
+     struct alignas(CACHE_LINE_SIZE) Shard
+     {
+       Shard() : value(0) {}
+       std::atomic<uint64_t> value;
+     };
+     /* the cpu id is cached per thread and refreshed every CPU_REFRESH updates, sched_getcpu is not free */
+     static const uint32_t CPU_REFRESH = 64;
+     struct ThreadShard
+     {
+       ThreadShard() : cpu(0), updates(0) {}
+       uint32_t cpu;
+       uint32_t updates;
+     };
+     uint32_t shard() const
+     {
+       static thread_local ThreadShard current;
+       if (__builtin_expect(0 == current.updates++ % CPU_REFRESH, 0)) current.cpu = currentCpu();
+       return current.cpu & _mask;
+     }
+     static __attribute__((noinline)) uint32_t currentCpu()
+     {
+       int cpu = sched_getcpu();
+       if (cpu >= 0) return static_cast<uint32_t>(cpu);
+       return static_cast<uint32_t>(std::hash<std::thread::id>()(std::this_thread::get_id()) * 0x9E3779B1u);
+     }
+     Shard* _shards;
+     uint32_t _mask;
+};
+
+
+/*
+ * LabelSet - the label tuples of one labeled stat (method x status x region). Every distinct tuple gets a dense
+ * series id, the collectionId of its records, so the collector merges the threads per (statId, series) like any
+ * collection. Shared by all the threads; series() locks and is meant to be resolved once and cached at the call site.
+ * Cardinality cap: at most maxSeries tuples get a series, every tuple after that maps to OVERFLOW_SERIES, so a
+ * label explosion (a user id as a label) costs nothing more than one counter.
+ *    static LabelSet httpRequests(HTTP_REQUESTS_ID, {"method", "status", "region"}, 500);
+ *    static const uint32_t getOk = httpRequests.series({"GET", "200", "eu"});
+ */
+class LabelSet : public NCA
+{
+  public:
+     static const uint32_t OVERFLOW_SERIES = 0;
+
+     LabelSet(uint32_t statId, const std::vector<std::string>& labels, uint32_t maxSeries = 1000)
+      : _statId(statId), _labels(labels), _maxSeries(maxSeries), _overflowed(0)
+     {
+        _values.push_back(std::vector<std::string>()); //OVERFLOW_SERIES
+     }
+     /* series of a tuple of label values, in the order of the labels, OVERFLOW_SERIES past the cap */
+     uint32_t series(const std::vector<std::string>& values)
+     {
+        if (values.size() != _labels.size()) throw std::invalid_argument("label values do not match the labels");
+        std::string key;
+        for (const auto& value : values) key.append(value).push_back('\x1f');
+        std::lock_guard<std::mutex> lck (_mtx);
+        auto it = _series.find(key);
+        if (it != _series.end()) return it->second;
+        if (_values.size() > _maxSeries)
+        {
+           ++_overflowed;
+           return OVERFLOW_SERIES;
+        }
+        uint32_t series = _values.size();
+        _values.push_back(values);
+        _series.emplace(std::move(key), series);
+        return series;
+     }
+     /* label values of a series, empty for OVERFLOW_SERIES, collector / exporter side */
+     std::vector<std::string> values(uint32_t series) const
+     {
+        std::lock_guard<std::mutex> lck (_mtx);
+        return series < _values.size() ? _values[series] : std::vector<std::string>();
+     }
+     uint32_t statId() const { return _statId; }
+     const std::vector<std::string>& labels() const { return _labels; }
+     uint32_t maxSeries() const { return _maxSeries; }
+     /* series given so far, OVERFLOW_SERIES not counted */
+     uint32_t size() const
+     {
+        std::lock_guard<std::mutex> lck (_mtx);
+        return _values.size() - 1;
+     }
+     /* series() calls that got OVERFLOW_SERIES */
+     uint64_t overflowed() const
+     {
+        std::lock_guard<std::mutex> lck (_mtx);
+        return _overflowed;
+     }
+  private:
+     uint32_t _statId;
+     std::vector<std::string> _labels;
+     uint32_t _maxSeries;
+     mutable std::mutex _mtx;
+     std::unordered_map<std::string, uint32_t> _series;  //< label values joined by \x1f -> series
+     std::vector<std::vector<std::string> > _values;      //< by series
+     uint64_t _overflowed;
+};
+
+/*
+ * concreate class, the counters of one LabelSet owned by a thread (like GlobalStats), one slot per series.
+ * Slots are allocated in chunks of 64 series on the first update of a series of the chunk, a thread only pays for
+ * the series it touches and never more than the cap of the set. An update is an indexed single writer add.
+ * The collector takes the deltas of a chunk in one vector pass and emits a record per series that changed.
+ *    LabeledStats requests(httpRequests);   //thread owned
+ *    requests.inc(getOk);
+ */
+class LabeledStats final: public BaseCounter
+{
+ 
+public:
+     static const uint32_t CHUNK_SERIES = 64;
+
+     explicit LabeledStats(LabelSet& labelSet)
+      : BaseCounter(labelSet.statId(), StatType::ARRAY_OF_STATS, 0, true), _labelSet(labelSet)
+        ,_chunkCount(labelSet.maxSeries() / CHUNK_SERIES + 1), _chunks(new std::atomic<Chunk*>[_chunkCount])
+     {
+       for (uint32_t i = 0; i < _chunkCount; ++i) _chunks[i].store(nullptr, std::memory_order_relaxed);
+       ADD_STATS_OBJ(this); //call only from concrete class   
+     }
+     virtual ~LabeledStats() 
+     { 
+       DEL_STATS_OBJ(this); //call only from concrete class 
+       for (uint32_t i = 0; i < _chunkCount; ++i) delete _chunks[i].load(std::memory_order_relaxed);
+     } 
+     /* owner thread only, hides BaseCounter::inc/dec */
+     void inc(uint32_t series, uint64_t val = 1)
+     {
+       std::atomic<uint64_t>& slot = this->slot(series);
+       slot.store(slot.load(std::memory_order_relaxed) + val, std::memory_order_relaxed);
+     }
+     void dec(uint32_t series, uint64_t val = 1) { inc(series, -val); }
+     uint64_t getStatValue(uint32_t series)
+     {
+       Chunk* chunk = series < _chunkCount * CHUNK_SERIES ? _chunks[series / CHUNK_SERIES].load(std::memory_order_acquire) : nullptr;
+       return chunk ? chunk->values[series % CHUNK_SERIES].load(std::memory_order_relaxed) : 0;
+     }
+     LabelSet& labelSet() { return _labelSet; }
+     /* bytes of the slots this thread allocated */
+     uint64_t memory() const
+     {
+       uint64_t chunks = 0;
+       for (uint32_t i = 0; i < _chunkCount; ++i) chunks += nullptr != _chunks[i].load(std::memory_order_relaxed);
+       return chunks * sizeof(Chunk) + _chunkCount * sizeof(std::atomic<Chunk*>);
+     }
+     virtual void collect(StatsSnapshot& snapshot)
+     {
+       uint64_t current[CHUNK_SERIES], deltas[CHUNK_SERIES];
+       for (uint32_t i = 0; i < _chunkCount; ++i)
+       {
+         Chunk* chunk = _chunks[i].load(std::memory_order_acquire);
+         if (!chunk) continue;
+         SimdKernels::load(current, chunk->values, CHUNK_SERIES);
+         if (!SimdKernels::delta(deltas, current, chunk->lastSeen, CHUNK_SERIES)) continue;
+         for (uint32_t j = 0; j < CHUNK_SERIES; ++j)
+         {
+           if (deltas[j]) snapshot.add(_statId, i * CHUNK_SERIES + j, deltas[j], _type);
+         }
+       }
+     }
+private:
+     struct Chunk
+     {
+       Chunk()
+       {
+         for (uint32_t i = 0; i < CHUNK_SERIES; ++i)
+         {
+           values[i].store(0, std::memory_order_relaxed);
+           lastSeen[i] = 0;
+         }
+       }
+       std::atomic<uint64_t> values[CHUNK_SERIES];
+       uint64_t lastSeen[CHUNK_SERIES]; //< collector side
+     };
+     std::atomic<uint64_t>& slot(uint32_t series)
+     {
+       if (__builtin_expect(series >= _chunkCount * CHUNK_SERIES, 0)) series = LabelSet::OVERFLOW_SERIES;
+       Chunk* chunk = _chunks[series / CHUNK_SERIES].load(std::memory_order_relaxed);
+       if (__builtin_expect(nullptr == chunk, 0)) chunk = addChunk(series / CHUNK_SERIES);
+       return chunk->values[series % CHUNK_SERIES];
+     }
+     /* published with release, the collector sees the zeroed slots before the pointer */
+     __attribute__((noinline)) Chunk* addChunk(uint32_t idx)
+     {
+       Chunk* chunk = new Chunk();
+       _chunks[idx].store(chunk, std::memory_order_release);
+       return chunk;
+     }
+     LabelSet& _labelSet;
+     uint32_t _chunkCount;
+     std::unique_ptr<std::atomic<Chunk*>[]> _chunks;
+};
+
+/*
+ * FlatMap32 - open addressing map with uint32_t keys, keys and values in separate arrays so a probe only walks keys.
+ * Collector side only, not thread safe.
+ */
+template <typename V>
+class FlatMap32
+{
+  public:
+     static const uint32_t EMPTY_KEY = ~0u;
+
+     explicit FlatMap32(uint32_t capacity = 16) : _size(0) { allocate(capacity); }
+     V& operator[](uint32_t key)
+     {
+        uint32_t idx = find(key);
+        if (_keys[idx] == key) return _values[idx];
+        if ((_size + 1) * 10 > _keys.size() * 7)
+        {
+           grow();
+           idx = find(key);
+        }
+        ++_size;
+        _keys[idx] = key;
+        return _values[idx];
+     }
+     /* nullptr when not found */
+     const V* get(uint32_t key) const
+     {
+        uint32_t idx = find(key);
+        return _keys[idx] == key ? &_values[idx] : nullptr;
+     }
+     template <typename F>
+     void forEach(F f) const
+     {
+        for (size_t i = 0; i < _keys.size(); ++i)
+           if (_keys[i] != EMPTY_KEY) f(_keys[i], _values[i]);
+     }
+     uint32_t size() const { return _size; }
+  private:
+     uint32_t find(uint32_t key) const
+     {
+        uint32_t mask = _keys.size() - 1;
+        uint32_t idx = (key * 0x9E3779B1u) & mask;
+        while (_keys[idx] != key && _keys[idx] != EMPTY_KEY) idx = (idx + 1) & mask;
+        return idx;
+     }
+     void allocate(uint32_t capacity)
+     {
+        uint32_t cap = 16;
+        while (cap < capacity) cap <<= 1;
+        _keys.assign(cap, uint32_t(EMPTY_KEY));
+        _values.assign(cap, V());
+     }
+     void grow()
+     {
+        std::vector<uint32_t> keys;
+        std::vector<V> values;
+        keys.swap(_keys);
+        values.swap(_values);
+        allocate(keys.size() * 2);
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+           if (keys[i] == EMPTY_KEY) continue;
+           uint32_t idx = find(keys[i]);
+           _keys[idx] = keys[i];
+           _values[idx] = values[i];
+        }
+     }
+     std::vector<uint32_t> _keys;
+     std::vector<V> _values;
+     uint32_t _size;
+};
+
+/*
+ * StatsAggregator - collector side totals, indexed (statId, collectionId) -> value.
+ * Two level flat table: statId -> dense StatAggregate (rolled up total + its collections),
+ * collectionId -> value inside it. GLOBAL_STATS are a stat with the single collection 0.
+ * Merging a record is two flat lookups, the previous stat is cached since records of one stat come together.
+ */
+class StatsAggregator : public NCA
+{
+  public:
+     struct StatAggregate
+     {
+        uint32_t statId;
+        StatType type;
+        uint64_t total;                    //< rolled up over all collections, number of samples for HISTOGRAM
+        FlatMap32<uint64_t> collections;   //< collectionId -> value
+        std::unique_ptr<HistogramData> interval; //< HISTOGRAM only, samples of the last merged interval
+     };
+
+     StatsAggregator() : _last(nullptr), _lastMerge(std::chrono::steady_clock::now()) {}
+     /* every merge is one collection interval, the exporters get the totals of every (statId, collectionId) */
+     void merge(const StatsSnapshot& snapshot)
+     {
+        for(auto idx : _histograms) _stats[idx].interval->clear();
+        for(auto& record: snapshot)
+        {
+           if (0 == record.value) continue;
+           StatAggregate& stat = getStat(record.statId);
+           stat.type = record.type;
+           stat.total += record.value;
+           stat.collections[record.collectionId] += record.value;
+           if (StatType::HISTOGRAM == record.type)
+           {
+              if (!stat.interval)
+              {
+                 stat.interval.reset(new HistogramData());
+                 _histograms.push_back(&stat - &_stats[0]);
+              }
+              stat.interval->add(record.bucket, record.value);
+           }
+        }
+        if (!_exporters.empty()) exportStats();
+     }
+     /* not owned, must outlive the aggregator */
+     void addExporter(StatsExporter* exporter) { _exporters.push_back(exporter); }
+     /* histogram of the last merged interval, nullptr if statId is not a HISTOGRAM */
+     const HistogramData* intervalHistogram(uint32_t statId) const
+     {
+        const StatAggregate* stat = find(statId);
+        return stat ? stat->interval.get() : nullptr;
+     }
+     /* rolled up value of a stat */
+     uint64_t total(uint32_t statId) const
+     {
+        const StatAggregate* stat = find(statId);
+        return stat ? stat->total : 0;
+     }
+     /* value of one collection of a stat */
+     uint64_t value(uint32_t statId, uint32_t collectionId) const
+     {
+        const StatAggregate* stat = find(statId);
+        const uint64_t* value = stat ? stat->collections.get(collectionId) : nullptr;
+        return value ? *value : 0;
+     }
+     /* f(collectionId, value) for every collection of statId */
+     template <typename F>
+     void forEachCollection(uint32_t statId, F f) const
+     {
+        const StatAggregate* stat = find(statId);
+        if (stat) stat->collections.forEach(f);
+     }
+     /* f(const StatAggregate&) in registration order */
+     template <typename F>
+     void forEachStat(F f) const
+     {
+        for (auto& stat : _stats) f(stat);
+     }
+  private:
+     const StatAggregate* find(uint32_t statId) const
+     {
+        const uint32_t* idx = _index.get(statId);
+        return idx ? &_stats[*idx - 1] : nullptr;
+     }
+     StatAggregate& getStat(uint32_t statId)
+     {
+        if (_last && _last->statId == statId) return *_last;
+        uint32_t& idx = _index[statId];
+        if (0 == idx)
+        {
+           StatAggregate stat;
+           stat.statId = statId;
+           stat.total = 0;
+           _stats.push_back(std::move(stat));
+           idx = _stats.size(); //index + 1, 0 is a new entry
+        }
+        _last = &_stats[idx - 1];
+        return *_last;
+     }
+     void exportStats()
+     {
+        auto now = std::chrono::steady_clock::now();
+        uint64_t timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+        uint64_t interval = std::chrono::duration_cast<std::chrono::nanoseconds>(now - _lastMerge).count();
+        _lastMerge = now;
+        _exportRecords.clear();
+        for (auto& stat : _stats)
+        {
+           stat.collections.forEach([&](uint32_t collectionId, uint64_t value)
+           {
+              ExportRecord record = { stat.statId, collectionId, static_cast<uint8_t>(stat.type), value };
+              _exportRecords.push_back(record);
+           });
+        }
+        for (auto exporter : _exporters)
+           exporter->exportStats(timestamp, interval, _exportRecords.data(), _exportRecords.size());
+     }
+     FlatMap32<uint32_t> _index;        //< statId -> position in _stats + 1
+     std::vector<StatAggregate> _stats;
+     std::vector<uint32_t> _histograms; //< positions in _stats of the HISTOGRAM stats
+     StatAggregate* _last;
+     std::vector<StatsExporter*> _exporters;
+     std::vector<ExportRecord> _exportRecords; //< reused every interval
+     std::chrono::steady_clock::time_point _lastMerge;
 };
 
+/*
+ * SelfStats - the stats library about itself: the collector thread records the StatsMap::usage() of its last
+ * fetch() in counters it owns, on the regular update path, under the SELF_*_STAT_ID ids of StatsCollector.h; the
+ * next fetch() collects them with the other counters.
+ *    SelfStats self; //collector thread
+ *    StatsCollector collector([&]() { FETCH_STATS_OBJ(snapshot); aggregator.merge(snapshot); self.record(); });
+ * The fetch time is a HISTOGRAM (p50 / p99 from the aggregator), the gauges (counters, bytes) move by the change of
+ * their value so the aggregated total is the current value, the other stats are summed per interval.
+ */
+class SelfStats : public NCA
+{
+  public:
+     SelfStats()
+      : _fetchNs(SELF_COLLECT_NS_STAT_ID), _lockWaitNs(SELF_LOCK_WAIT_NS_STAT_ID), _lockHoldNs(SELF_LOCK_HOLD_NS_STAT_ID)
+        , _counters(SELF_MAPS_STAT_ID), _bytes(SELF_BYTES_STAT_ID), _allocations(SELF_ALLOCATIONS_STAT_ID)
+        , _created(SELF_NEW_KEYS_STAT_ID) {}
+     void record()
+     {
+        const StatsMap::Usage& usage = StatsMap::getInstance().usage();
+        _fetchNs.record(usage.fetchNs);
+        _lockWaitNs.inc(usage.collectWaitNs + usage.lockWaitNs);
+        _lockHoldNs.inc(usage.fetchNs - usage.collectWaitNs);
+        set(_counters, usage.counters);
+        set(_bytes, usage.bytes);
+        _allocations.inc(usage.allocations);
+        _created.inc(usage.created);
+     }
+  private:
+     static void set(GlobalStats& gauge, uint64_t value) { gauge.inc(value - gauge.getStatValue()); }
+
+     HistogramStats _fetchNs;
+     GlobalStats _lockWaitNs;
+     GlobalStats _lockHoldNs;
+     GlobalStats _counters;
+     GlobalStats _bytes;
+     GlobalStats _allocations;
+     GlobalStats _created;
+};
 
-//TEST code starts here
+//TEST code starts here, -DSTATS_NO_MAIN builds only the stats classes (Test/bench_*.cpp include this file)
+#ifndef STATS_NO_MAIN
 //testing
 /*
  * all thread waits until it is ready object. stats are incremented once this value is set to true.  
  * collector signals thread to stop incrementing counter by sresetting ready value;
  */   
-bool ready = false;
-//dumpCollectedStats - collector starts dumping aggregated stats to console 
-bool dumpCollectedStats = false;
+std::atomic<bool> ready(false);
+//raceStarted / workersDone - the collector blocks on them, starts collecting and dumps the aggregated stats
+StatsEvent raceStarted;
+StatsEvent workersDone;
 
 //following variables are used if LOCAL_ATOMIC is not defined
 std::atomic<uint64_t> _global(0);
 std::atomic<uint64_t> _globalGroup(0);
+#ifdef STRIPED_ATOMIC
+//shared by all the threads instead of a counter per thread
+StripedStats _stripedGlobal(0);
+StripedStats _stripedGroup(10);
+#endif
+
+/* number of 1 second collection cycles, define a large value for a long running test */
+#ifndef COLLECT_CYCLES
+#define COLLECT_CYCLES 15
+#endif
+
+/*
+ * counts every heap allocation of the process, the collection cycle must not allocate in steady state.
+ * The whole family is replaced (array and sized forms) and kept out of line, so the compiler never pairs the
+ * malloc() / free() inside them with a new / delete expression (-Wmismatched-new-delete)
+ */
+std::atomic<uint64_t> allocations(0);
+__attribute__((noinline)) void* operator new(size_t size)
+{
+   ++allocations;
+   void* ptr = malloc(size ? size : 1);
+   if(nullptr == ptr) throw std::bad_alloc();
+   return ptr;
+}
+__attribute__((noinline)) void* operator new[](size_t size) { return operator new(size); }
+__attribute__((noinline)) void operator delete(void* ptr) noexcept { free(ptr); }
+__attribute__((noinline)) void operator delete[](void* ptr) noexcept { free(ptr); }
+__attribute__((noinline)) void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+__attribute__((noinline)) void operator delete[](void* ptr, size_t) noexcept { free(ptr); }
+
+//statLabel - "10", or "10 (rpc.server.requests)" for an interned stat id
+std::string statLabel(uint32_t statId)
+{
+   const char* name = StatsNames::getInstance().name(statId);
+   return std::to_string(statId) + (name ? std::string(" (") + name + ")" : std::string());
+}
+
+//printLatency - p50/p99/p999 of the last interval of every histogram stat
+void printLatency(const StatsAggregator& aggregator)
+{
+   aggregator.forEachStat([](const StatsAggregator::StatAggregate& stat)
+   {
+     if (!stat.interval || 0 == stat.interval->count()) return;
+     std::cout << "id: " << statLabel(stat.statId) << " samples: " << stat.interval->count()
+               << " p50: " << stat.interval->percentile(0.5) << " p99: " << stat.interval->percentile(0.99)
+               << " p999: " << stat.interval->percentile(0.999) << std::endl;
+   });
+}
+
+//printRates - per second rate of every (statId, collectionId) over the last seconds
+void printRates(const StatsAggregator& aggregator, const StatsHistory& history, double seconds)
+{
+   aggregator.forEachStat([&](const StatsAggregator::StatAggregate& stat)
+   {
+     stat.collections.forEach([&](uint32_t collectionId, uint64_t)
+     {
+       std::cout << "id: " << statLabel(stat.statId) << " collection: " << collectionId << " rate(" << seconds << "s): "
+                 << history.rate(stat.statId, collectionId, seconds) << "/s\n";
+     });
+   });
+}
 
 //collectstats - start collecting stats and print aggregated values
 void collectstats() 
 {
-   std::vector<BaseCounter*> statsValues;
-   statsValues.reserve(300);
-   uint32_t maxcount = 15;
-   while(!ready) {}
-   while(maxcount--)
+   StatsSnapshot snapshot;
+   StatsAggregator _gStatsData;
+   StatsHistory history(300); //5 minutes of intervals
+   _gStatsData.addExporter(&history);
+#ifdef EXPORT_FILE
+   FileExporter exporter(EXPORT_FILE);
+   _gStatsData.addExporter(&exporter);
+#endif
+#ifdef SHM_PATH
+   ShmExporter shm(SHM_PATH, 100000);
+   _gStatsData.addExporter(&shm);
+#endif
+   HistogramStats passTime(COLLECTOR_PASS_STAT_ID); //recorded by the collector thread only
+   SelfStats self;                                  //same
+   uint64_t passAllocations = 0;
+   uint32_t cycles = 0;
+   StatsCollector collector([&]()
    {
-     /* fetch stats every 1 second */
-     std::this_thread::sleep_for(std::chrono::seconds(1));
-     std::vector<BaseCounter*> tmp = FETCH_STATS_OBJ();
-     statsValues.insert(statsValues.end(), tmp.begin(), tmp.end());
-    //std::cout << "size: "<<statsValues.size()<<std::endl;
-   }
-   //std::cout << "Exiting collector \n";
-   ready = false;
-   while(!dumpCollectedStats) {} //wait for all threads to finish
-   std::vector<BaseCounter*> tmp = FETCH_STATS_OBJ();
-   statsValues.insert(statsValues.end(), tmp.begin(), tmp.end());
+     uint64_t before = allocations;
+     FETCH_STATS_OBJ(snapshot);
+     _gStatsData.merge(snapshot);
+     passAllocations = allocations - before;
+     self.record();
+   });
+   collector.onPassDone([&passTime](uint64_t passNs) { passTime.record(passNs); });
+   /* every second, stops the race after COLLECT_CYCLES */
+   collector.subscribe(std::chrono::seconds(1), [&](bool final)
+   {
+     if (final) return;
+     std::cout << "collection cycle: " << snapshot.size() << " records, allocations: " << passAllocations
+               << ", snapshot memory: " << snapshot.capacity() * sizeof(StatRecord) << " bytes, pass: "
+               << collector.lastPassNs() / 1000 << " us\n";
+     const StatsMap::Usage& usage = StatsMap::getInstance().usage();
+     std::cout << "   self: " << usage.counters << " counters, " << usage.bytes << " bytes, fetch " << usage.fetchNs / 1000
+               << " us, lock wait " << (usage.collectWaitNs + usage.lockWaitNs) / 1000 << " us, " << usage.created
+               << " counters created\n";
+     printLatency(_gStatsData); //the pass and fetch times (COLLECTOR_PASS_STAT_ID, SELF_COLLECT_NS_STAT_ID) too
+     if (++cycles == COLLECT_CYCLES) ready = false;
+   });
+   collector.subscribe(std::chrono::seconds(10), [&](bool final)
+   {
+     if (!final) printRates(_gStatsData, history, 10);
+   });
+#ifdef COLLECTOR_CPU
+   collector.setAffinity(COLLECTOR_CPU);
+#endif
+   raceStarted.wait();
+   collector.start();
+   workersDone.wait(); //wait for all threads to finish
+   collector.stop();   //final pass
   
-   // std::cout << "size: "<<statsValues.size()<<std::endl;
-   std::map<uint32_t, uint64_t> _gStatsData;
-   for(auto& it: statsValues)
+   _gStatsData.forEachStat([&history](const StatsAggregator::StatAggregate& stat)
    {
-     uint32_t id = it->getStatId(); 
-     uint64_t value = it->getStatValue();
-     //std::cout << "id: "<<id <<" value: "<<value<<std::endl;
-    //TODO, calculate collection based aggregation for stats type StatType::ARRAY_OF_STATS 
-     _gStatsData[id] += value;    
-   }
-   for(auto& it: _gStatsData) 
-     std::cout << "id: "<<it.first <<" value: "<<it.second<<std::endl;
+     std::cout << "id: "<<statLabel(stat.statId) <<" value: "<<stat.total<<std::endl;
+     stat.collections.forEach([&](uint32_t collectionId, uint64_t value)
+     {
+       if (stat.collections.size() > 1) std::cout << "   collection: "<<collectionId <<" value: "<<value<<std::endl;
+       std::cout << "   rate(10s): " << history.rate(stat.statId, collectionId, 10) << "/s max interval delta(5 min): "
+                 << history.maxDelta(stat.statId, collectionId, 300) << std::endl;
+     });
+   });
    
      std::cout << "global(0): "<<_global <<" _group(10): "<<_globalGroup<<std::endl;
   
@@ -262,6 +1084,8 @@ void golbalStatFunc (int threadid, int id) {
   {    
 #ifdef LOCAL_ATOMIC 
      stats.inc();   // go!, and increment
+#elif defined(STRIPED_ATOMIC)
+     _stripedGlobal.inc();
 #else
      _global++;
 #endif
@@ -279,6 +1103,8 @@ void collectionStatFunc(int threadid,int id) { //collection id
   {    
 #ifdef LOCAL_ATOMIC 
      stats.inc();   // go!, and increment
+#elif defined(STRIPED_ATOMIC)
+     _stripedGroup.inc();
 #else
      _globalGroup++;
 #endif
@@ -286,6 +1112,523 @@ void collectionStatFunc(int threadid,int id) { //collection id
   //std::cout << "Exiting collecion stats threadId: "<<threadid<<std::endl;
 };
 
+#ifdef FALSE_SHARING_TEST
+/*
+ * Many counters per thread packed close together: counter i belongs to thread i % threads, so neighbour
+ * counters are always updated by different threads. Run once with plain GlobalStats and once with
+ * CacheAligned<GlobalStats> and report the throughput of both layouts.
+ */
+struct PackedCounter
+{
+  explicit PackedCounter(uint32_t statId) : _counter(statId) {}
+  GlobalStats& get() { return _counter; }
+  GlobalStats _counter;
+};
+typedef CacheAligned<GlobalStats> PaddedCounter;
+
+template <typename Counter>
+void falseSharingWorker(Counter* counters, uint32_t threadId, uint32_t threads, uint32_t perThread, std::atomic<uint64_t>* total)
+{
+  uint64_t count = 0;
+  while (!ready) {}
+  while (ready)
+  {
+     for (uint32_t i = 0; i < perThread; ++i)
+     {
+        counters[i * threads + threadId].get().inc();
+     }
+     count += perThread;
+  }
+  *total += count;
+}
+
+template <typename Counter>
+double falseSharingRun(const char* layout, uint32_t threads, uint32_t perThread)
+{
+  uint32_t numCounters = threads * perThread;
+  void* buffer = nullptr;
+  if (::posix_memalign(&buffer, CACHE_LINE_SIZE, sizeof(Counter) * numCounters) != 0) throw std::bad_alloc();
+  Counter* counters = static_cast<Counter*>(buffer);
+  for (uint32_t i = 0; i < numCounters; ++i) ::new (&counters[i]) Counter(i);
+
+  std::atomic<uint64_t> total(0);
+  std::vector<std::thread> workers;
+  ready = false;
+  for (uint32_t t = 0; t < threads; ++t)
+     workers.push_back(std::thread(falseSharingWorker<Counter>, counters, t, threads, perThread, &total));
+  auto start = std::chrono::high_resolution_clock::now();
+  ready = true;
+  std::this_thread::sleep_for(std::chrono::seconds(3));
+  ready = false;
+  for (auto& th : workers) th.join();
+  auto end = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double> elapsed = end-start;
+
+  for (uint32_t i = 0; i < numCounters; ++i) counters[i].~Counter();
+  ::free(buffer);
+  double rate = total / elapsed.count();
+  std::cout << layout << ": counter size " << sizeof(Counter) << " bytes, " << (uint64_t)rate << " increments/sec\n";
+  return rate;
+}
+
+int main ()
+{
+  uint32_t threads = std::max(2u, std::thread::hardware_concurrency());
+  uint32_t perThread = 16;
+  std::cout << threads << " threads, " << perThread << " counters per thread\n";
+  double packed = falseSharingRun<PackedCounter>("padding off", threads, perThread);
+  double padded = falseSharingRun<PaddedCounter>("padding on ", threads, perThread);
+  std::cout << "padding speedup: " << padded / packed << "x\n";
+  StatsMap::getInstance().clear();
+  return 0;
+}
+#elif defined(HISTOGRAM_TEST)
+/* one thread records synthetic latencies (mostly ~1us, 1% ~50us, 0.1% ~1ms), the collector reports percentiles per interval */
+void latencyStatFunc(std::atomic<uint64_t>* recorded)
+{
+  HistogramStats latency(20);
+  uint64_t seed = 88172645463325252ULL;
+  uint64_t count = 0;
+  while (!ready) {}
+  auto start = std::chrono::high_resolution_clock::now();
+  while (ready)
+  {
+     for (int i = 0; i < 1000; ++i)
+     {
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17; //xorshift
+        uint64_t r = seed % 1000;
+        uint64_t value = r < 1 ? 1000000 : r < 10 ? 50000 : 1000;
+        latency.record(value + (seed >> 54));
+     }
+     count += 1000;
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double, std::nano> elapsed = end-start;
+  std::cout << count << " values recorded, " << elapsed.count() / count << " ns per record\n";
+  *recorded = count;
+}
+
+int main ()
+{
+  std::atomic<uint64_t> recorded(0);
+  std::thread worker(latencyStatFunc, &recorded);
+  StatsSnapshot snapshot;
+  StatsAggregator aggregator;
+  ready = true;
+  for (int interval = 0; interval < 5; ++interval)
+  {
+     std::this_thread::sleep_for(std::chrono::seconds(1));
+     FETCH_STATS_OBJ(snapshot);
+     aggregator.merge(snapshot);
+     printLatency(aggregator);
+  }
+  ready = false;
+  worker.join();
+  FETCH_STATS_OBJ(snapshot);
+  aggregator.merge(snapshot);
+  std::cout << "total samples: " << aggregator.total(20) << (aggregator.total(20) == recorded ? " OK" : " MISMATCH") << std::endl;
+  return aggregator.total(20) == recorded ? 0 : 1;
+}
+#elif defined(EXPORT_TEST)
+/* 100k (statId, collectionId) stats: time the binary encoding of one interval, decode it back and check */
+int main ()
+{
+  const uint32_t count = 100000;
+  const uint32_t intervals = 100;
+  std::vector<ExportRecord> records(count);
+  for (uint32_t i = 0; i < count; ++i)
+  {
+     ExportRecord record = { 10 + i / 100, i % 100, static_cast<uint8_t>(StatType::ARRAY_OF_STATS), 1000000ULL * i };
+     records[i] = record;
+  }
+  SnapshotEncoder encoder(count, 10);
+  SnapshotDecoder decoder;
+  bool ok = true;
+  double worst = 0, total = 0;
+  size_t bytes = 0;
+  uint64_t before = allocations;
+  for (uint32_t interval = 0; interval < intervals; ++interval)
+  {
+     for (uint32_t i = 0; i < count; ++i) records[i].value += i % 7 ? i % 1000 : 0;
+     if (55 == interval) records[count / 3].kind = static_cast<uint8_t>(StatType::GLOBAL_STATS); //kind change in a delta frame
+     auto start = std::chrono::high_resolution_clock::now();
+     encoder.encode(interval * 1000000000ULL, 1000000000ULL, records.data(), count);
+     auto end = std::chrono::high_resolution_clock::now();
+     std::chrono::duration<double, std::milli> elapsed = end-start;
+     worst = std::max(worst, elapsed.count());
+     total += elapsed.count();
+     bytes += encoder.size();
+     ok = ok && decoder.decode(encoder.data(), encoder.size()) && decoder.records().size() == count
+             && decoder.records()[count - 1].value == records[count - 1].value
+             && decoder.records()[count / 2].collectionId == records[count / 2].collectionId
+             && decoder.records()[count / 3].kind == records[count / 3].kind;
+  }
+  std::cout << count << " stats, " << intervals << " intervals (keyframe every 10): encode avg " << total / intervals
+            << " ms, max " << worst << " ms, avg frame " << bytes / intervals << " bytes ("
+            << double(bytes) / intervals / count << " bytes per stat), allocations: " << allocations - before
+            << (ok ? " OK" : " MISMATCH") << std::endl;
+  return ok ? 0 : 1;
+}
+#elif defined(HISTORY_TEST)
+/* 100k stats kept for 300 intervals, known per interval deltas: check the window queries, report memory and time */
+int main ()
+{
+  const uint32_t count = 100000;
+  const uint32_t intervals = 650; //ring wraps twice, columns compacted
+  const uint64_t second = 1000000000ULL;
+  std::vector<ExportRecord> records(count);
+  for (uint32_t i = 0; i < count; ++i)
+  {
+     ExportRecord record = { 10 + i / 100, i % 100, static_cast<uint8_t>(StatType::ARRAY_OF_STATS), 0 };
+     records[i] = record;
+  }
+  StatsHistory history(300);
+  double worst = 0, total = 0;
+  for (uint32_t interval = 1; interval <= intervals; ++interval)
+  {
+     /* stat i moves by i % 1000 a second, a spike of 1000000 on interval 500 for record 0 */
+     for (uint32_t i = 0; i < count; ++i) records[i].value += i % 1000 + (0 == i && 500 == interval ? 1000000 : 0);
+     auto start = std::chrono::high_resolution_clock::now();
+     history.exportStats(interval * second, second, records.data(), count);
+     auto end = std::chrono::high_resolution_clock::now();
+     double elapsed = std::chrono::duration<double, std::milli>(end-start).count();
+     worst = std::max(worst, elapsed);
+     total += elapsed;
+  }
+  auto start = std::chrono::high_resolution_clock::now();
+  double rate10 = history.rate(10 + 999 / 100, 999 % 100, 10);
+  double rate60 = history.rate(10 + 999 / 100, 999 % 100, 60);
+  int64_t spike = history.maxDelta(10, 0, 300);
+  int64_t noSpike = history.maxDelta(10, 0, 100);
+  auto end = std::chrono::high_resolution_clock::now();
+  bool ok = 999 == rate10 && 999 == rate60 && 1000000 == spike && 0 == noSpike && 300 == history.intervals();
+  std::cout << count << " stats, " << history.intervals() << " intervals kept: " << history.memory() / 1024 << " KB, add interval avg "
+            << total / intervals << " ms max " << worst << " ms, 4 queries " << std::chrono::duration<double, std::micro>(end-start).count() << " us, rate(10s) "
+            << rate10 << " rate(60s) " << rate60 << " max delta(5 min) " << spike << (ok ? " OK" : " MISMATCH") << std::endl;
+  return ok ? 0 : 1;
+}
+#elif defined(SHM_TEST)
+/*
+ * writers at full rate on 4000 collections, the collector publishes every millisecond in the shared memory
+ * segment while statsreader -c checks the snapshots from another process (shm_test.sh)
+ */
+#ifndef SHM_PATH
+#define SHM_PATH "/dev/shm/localstats_test"
+#endif
+#ifndef SHM_SECONDS
+#define SHM_SECONDS 5
+#endif
+void shmWriterFunc(int threadid)
+{
+  std::vector<std::unique_ptr<CollectionStats> > stats;
+  for (uint32_t i = 0; i < 1000; ++i) stats.push_back(std::unique_ptr<CollectionStats>(new CollectionStats(10 + threadid, i)));
+  while (!ready) {}
+  while (ready)
+  {
+     for (auto& stat : stats) stat->inc();
+  }
+}
+
+int main ()
+{
+  ShmExporter shm(SHM_PATH, 100000);
+  StatsSnapshot snapshot;
+  StatsAggregator aggregator;
+  aggregator.addExporter(&shm);
+  std::vector<std::thread> writers;
+  for (int i = 0; i < 4; ++i) writers.push_back(std::thread(shmWriterFunc, i));
+  ready = true;
+  auto end = std::chrono::steady_clock::now() + std::chrono::seconds(SHM_SECONDS);
+  while (std::chrono::steady_clock::now() < end)
+  {
+     FETCH_STATS_OBJ(snapshot);
+     aggregator.merge(snapshot);
+     std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  ready = false;
+  for (auto& th : writers) th.join();
+  FETCH_STATS_OBJ(snapshot);
+  aggregator.merge(snapshot);
+  std::cout << "published " << shm.sequence() / 2 << " intervals to " << SHM_PATH << std::endl;
+  return 0;
+}
+#elif defined(NAMES_TEST)
+/*
+ * 1M hierarchical names svc<0-99>.<rpc|db|cache|queue>.host<0-249>.<metric>: intern / lookup time, memory per name,
+ * prefix and glob queries checked against a full scan, then counters keyed by interned ids summed by a glob
+ */
+int main ()
+{
+  const char* subsystems[] = { "rpc", "db", "cache", "queue" };
+  const char* metrics[] = { "requests", "errors", "timeouts", "retries", "bytes_in", "bytes_out", "latency", "queued",
+                            "dropped", "open" };
+  std::vector<std::string> names;
+  names.reserve(1000000);
+  for (uint32_t svc = 0; svc < 100; ++svc)
+    for (const char* subsystem : subsystems)
+      for (uint32_t host = 0; host < 250; ++host)
+        for (const char* metric : metrics)
+          names.push_back("svc" + std::to_string(svc) + "." + subsystem + ".host" + std::to_string(host) + "." + metric);
+
+  StatsNames& registry = StatsNames::getInstance();
+  auto start = std::chrono::high_resolution_clock::now();
+  for (const auto& name : names) registry.intern(name);
+  auto end = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double, std::nano> interned = end-start;
+
+  bool ok = registry.size() == names.size();
+  start = std::chrono::high_resolution_clock::now();
+  for (uint32_t id = 0; id < names.size(); ++id) ok = ok && registry.find(names[id]) == id;
+  end = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double, std::nano> found = end-start;
+  ok = ok && registry.intern(names[12345]) == 12345 && registry.size() == names.size()
+          && registry.find("svc1.rpc.host1") == StatsNames::NOT_FOUND && names[777] == registry.name(777);
+  std::cout << names.size() << " names: intern " << interned.count() / names.size() << " ns, find "
+            << found.count() / names.size() << " ns, memory " << double(registry.memory()) / names.size()
+            << " bytes per name" << (ok ? " OK" : " MISMATCH") << std::endl;
+
+  start = std::chrono::high_resolution_clock::now();
+  registry.forEachPrefix("~", [](uint32_t, const char*) {}); //past every name, only sorts the index
+  end = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double, std::milli> sorted = end-start;
+  std::cout << "sorted index (first query): " << sorted.count() << " ms" << std::endl;
+
+  const char* patterns[] = { "svc7.db.", "svc7.*.host1?.errors", "svc7.**.errors", "*.cache.host0.open", "svc42.rpc.host3.requests" };
+  for (const char* pattern : patterns)
+  {
+     bool prefix = nullptr == strpbrk(pattern, "*?");
+     std::vector<uint32_t> ids;
+     start = std::chrono::high_resolution_clock::now();
+     if (prefix) registry.forEachPrefix(pattern, [&ids](uint32_t id, const char*) { ids.push_back(id); });
+     else registry.forEachMatch(pattern, [&ids](uint32_t id, const char*) { ids.push_back(id); });
+     end = std::chrono::high_resolution_clock::now();
+     std::chrono::duration<double, std::micro> elapsed = end-start;
+     size_t expected = 0;
+     for (const auto& name : names)
+     {
+        expected += prefix ? 0 == name.compare(0, strlen(pattern), pattern) : StatsNames::match(pattern, name.c_str());
+     }
+     ok = ok && ids.size() == expected;
+     std::cout << (prefix ? "prefix " : "glob ") << pattern << ": " << ids.size() << " names in " << elapsed.count()
+               << " us" << (ids.size() == expected ? " OK" : " MISMATCH") << std::endl;
+  }
+
+  //hot path on the interned ids, the collector rolls them up by name
+  std::vector<std::unique_ptr<GlobalStats> > stats;
+  registry.forEachMatch("svc3.rpc.*.requests", [&stats](uint32_t id, const char*) { stats.push_back(std::unique_ptr<GlobalStats>(new GlobalStats(id))); });
+  for (auto& stat : stats) stat->inc(2);
+  StatsSnapshot snapshot;
+  StatsAggregator aggregator;
+  FETCH_STATS_OBJ(snapshot);
+  aggregator.merge(snapshot);
+  uint64_t total = 0;
+  registry.forEachMatch("svc3.*.*.requests", [&](uint32_t id, const char*) { total += aggregator.total(id); });
+  ok = ok && total == 2 * 250;
+  std::cout << "svc3.*.*.requests: " << total << (total == 2 * 250 ? " OK" : " MISMATCH") << std::endl;
+  stats.clear();
+  return ok ? 0 : 1;
+}
+#elif defined(LABELS_TEST)
+/*
+ * method x status x region = 60 label tuples, cap 50: 4 threads update every tuple through series ids cached at the
+ * call site, a label explosion (100k user ids) goes to the overflow series. Then 8 threads x 10000 series: time one
+ * collector pass (fetch + merge of the label sets of every thread).
+ */
+int main ()
+{
+  const char* methods[] = { "GET", "POST", "PUT", "DELETE" };
+  const char* statuses[] = { "200", "201", "404", "500", "503" };
+  const char* regions[] = { "eu", "us", "ap" };
+  const uint32_t threads = 4;
+  const uint64_t rounds = 100000;
+  LabelSet requests(30, {"method", "status", "region"}, 50);
+  std::vector<std::thread> workers;
+  std::atomic<uint64_t> updateNs(0);
+  std::atomic<uint64_t> threadMemory(0);
+  for (uint32_t t = 0; t < threads; ++t)
+  {
+     workers.push_back(std::thread([&, t]()
+     {
+       LabeledStats stats(requests);
+       std::vector<uint32_t> series; //the call site cache
+       for (const char* method : methods)
+         for (const char* status : statuses)
+           for (const char* region : regions) series.push_back(requests.series({method, status, region}));
+       auto start = std::chrono::high_resolution_clock::now();
+       for (uint64_t round = 0; round < rounds; ++round)
+         for (uint32_t s : series) stats.inc(s);
+       auto end = std::chrono::high_resolution_clock::now();
+       updateNs += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+       if (0 == t)
+       {
+          for (uint32_t user = 0; user < 100000; ++user) stats.inc(requests.series({"GET", "u" + std::to_string(user), "eu"}));
+       }
+       threadMemory += stats.memory();
+     }));
+  }
+  for (auto& th : workers) th.join();
+  StatsSnapshot snapshot;
+  StatsAggregator aggregator;
+  FETCH_STATS_OBJ(snapshot);
+  aggregator.merge(snapshot);
+  uint64_t perSeries = threads * rounds;
+  bool ok = requests.size() == 50 && requests.overflowed() == 100000 + 10 * threads
+         && aggregator.value(30, 1) == perSeries && aggregator.value(30, 50) == perSeries
+         && aggregator.value(30, LabelSet::OVERFLOW_SERIES) == 10 * perSeries + 100000
+         && aggregator.total(30) == 60 * perSeries + 100000 && requests.values(1)[0] == "GET";
+  std::cout << threads << " threads, 60 tuples cap 50: " << double(updateNs) / (threads * rounds * 60) << " ns per update, "
+            << requests.size() << " series, " << requests.overflowed() << " tuples to the overflow series, "
+            << threadMemory / threads << " bytes per thread" << (ok ? " OK" : " MISMATCH") << std::endl;
+  aggregator.forEachCollection(30, [&](uint32_t series, uint64_t value)
+  {
+     if (series > 3) return;
+     std::vector<std::string> values = requests.values(series);
+     std::cout << "   ";
+     for (uint32_t i = 0; i < values.size(); ++i) std::cout << requests.labels()[i] << "=" << values[i] << " ";
+     std::cout << (values.empty() ? "overflow " : "") << value << std::endl;
+  });
+
+  const uint32_t wide = 10000;
+  LabelSet users(31, {"user"}, wide);
+  std::vector<uint32_t> series;
+  for (uint32_t user = 0; user < wide; ++user) series.push_back(users.series({std::to_string(user)}));
+  std::vector<std::unique_ptr<LabeledStats> > stats;
+  for (uint32_t t = 0; t < 8; ++t) stats.push_back(std::unique_ptr<LabeledStats>(new LabeledStats(users)));
+  for (uint32_t pass = 1; pass <= 3; ++pass)
+  {
+     for (auto& stat : stats)
+       for (uint32_t s : series) stat->inc(s);
+     auto start = std::chrono::high_resolution_clock::now();
+     FETCH_STATS_OBJ(snapshot);
+     aggregator.merge(snapshot);
+     auto end = std::chrono::high_resolution_clock::now();
+     std::chrono::duration<double, std::milli> elapsed = end-start;
+     std::cout << "8 threads x " << wide << " series: " << snapshot.size() << " records, collector pass "
+               << elapsed.count() << " ms\n";
+  }
+  ok = ok && aggregator.value(31, series[wide / 2]) == 8 * 3 && aggregator.total(31) == 8 * 3 * uint64_t(wide);
+  std::cout << "user " << wide / 2 << ": " << aggregator.value(31, series[wide / 2]) << (ok ? " OK" : " MISMATCH") << std::endl;
+  stats.clear();
+  return ok ? 0 : 1;
+}
+#elif defined(CHURN_TEST)
+/*
+ * thread churn: waves of short lived threads, each with its own counters and request scoped counters created and
+ * destroyed in a loop, while the collector fetches every millisecond. The totals must be exact, nothing lost in the
+ * retirement of the counters. Then the cost of one counter create + destroy and its allocations.
+ */
+#ifndef CHURN_SECONDS
+#define CHURN_SECONDS 3
+#endif
+void churnThread(uint32_t id)
+{
+  GlobalStats global(50);
+  CollectionStats collection(51, id % 16);
+  HistogramStats latency(52);
+  for (uint32_t i = 0; i < 1000; ++i)
+  {
+     global.inc();
+     collection.inc(2);
+     latency.record(i);
+  }
+  for (uint32_t i = 0; i < 100; ++i)
+  {
+     GlobalStats request(53); //request scoped
+     request.inc(3);
+  }
+}
+int main ()
+{
+  std::atomic<bool> collecting(true);
+  StatsAggregator aggregator;
+  std::thread collector([&]()
+  {
+    StatsSnapshot snapshot(100000);
+    while (collecting)
+    {
+       FETCH_STATS_OBJ(snapshot);
+       aggregator.merge(snapshot);
+       std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+  uint64_t threads = 0;
+  auto start = std::chrono::steady_clock::now();
+  while (std::chrono::steady_clock::now() - start < std::chrono::seconds(CHURN_SECONDS))
+  {
+     std::vector<std::thread> wave;
+     for (uint32_t i = 0; i < 8; ++i) wave.push_back(std::thread(churnThread, threads++));
+     for (auto& th : wave) th.join();
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  collecting = false;
+  collector.join();
+  StatsSnapshot snapshot;
+  FETCH_STATS_OBJ(snapshot);
+  aggregator.merge(snapshot);
+  bool ok = aggregator.total(50) == 1000 * threads && aggregator.total(51) == 2000 * threads
+         && aggregator.value(51, 5) == 2000 * ((threads + 10) / 16) && aggregator.total(52) == 1000 * threads
+         && aggregator.total(53) == 300 * threads;
+  std::cout << threads << " threads in " << elapsed.count() << " s (" << threads / elapsed.count() << " threads/s, "
+            << threads * 103 / elapsed.count() << " counters retired/s): global " << aggregator.total(50)
+            << " collection " << aggregator.total(51) << " histogram " << aggregator.total(52) << " request scoped "
+            << aggregator.total(53) << (ok ? " OK" : " MISMATCH") << std::endl;
+
+  const uint32_t counters = 1000000;
+  StatsSnapshot drained(100000);
+  uint64_t before = allocations;
+  auto begin = std::chrono::high_resolution_clock::now();
+  for (uint32_t i = 1; i <= counters; ++i)
+  {
+     GlobalStats request(54);
+     request.inc();
+     if (0 == i % 16384) //the collector keeps up with the queue
+     {
+        FETCH_STATS_OBJ(drained);
+        aggregator.merge(drained);
+     }
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double, std::nano> churn = end-begin;
+  uint64_t allocated = allocations - before;
+  FETCH_STATS_OBJ(snapshot);
+  aggregator.merge(snapshot);
+  ok = ok && aggregator.total(54) == counters;
+  std::cout << "counter create + destroy: " << churn.count() / counters << " ns, allocations: " << allocated
+            << (ok ? " OK" : " MISMATCH") << std::endl;
+  return ok ? 0 : 1;
+}
+#elif defined(COLLECTION_SCALE_TEST)
+/* 100k collections of one stat id, every collection changes every pass: time one collector pass (fetch + merge) */
+int main ()
+{
+  const uint32_t statId = 10;
+  const uint32_t collections = 100000;
+  const uint32_t passes = 5;
+  std::vector<std::unique_ptr<CollectionStats> > stats;
+  stats.reserve(collections);
+  for (uint32_t i = 0; i < collections; ++i) stats.push_back(std::unique_ptr<CollectionStats>(new CollectionStats(statId, i)));
+
+  StatsSnapshot snapshot(collections);
+  StatsAggregator aggregator;
+  for (uint32_t pass = 1; pass <= passes; ++pass)
+  {
+     for (auto& stat : stats) stat->inc(pass);
+     auto start = std::chrono::high_resolution_clock::now();
+     FETCH_STATS_OBJ(snapshot);
+     aggregator.merge(snapshot);
+     auto end = std::chrono::high_resolution_clock::now();
+     std::chrono::duration<double, std::milli> elapsed = end-start;
+     std::cout << "pass " << pass << ": " << snapshot.size() << " records, collector pass " << elapsed.count() << " ms\n";
+  }
+  uint64_t perCollection = passes * (passes + 1) / 2;
+  bool ok = aggregator.total(statId) == perCollection * collections
+         && aggregator.value(statId, collections / 2) == perCollection;
+  std::cout << "rolled up: " << aggregator.total(statId) << " collection " << collections / 2 << ": "
+            << aggregator.value(statId, collections / 2) << (ok ? " OK" : " MISMATCH") << std::endl;
+  stats.clear();
+  return ok ? 0 : 1;
+}
+#else
 //to test performance set macro LOCAL_ATOMIC to 0 for global stats  and 1  for localized stats
 int main ()
 {
@@ -304,6 +1647,7 @@ int main ()
   std::this_thread::sleep_for(std::chrono::seconds(1));
   auto start = std::chrono::high_resolution_clock::now();
   ready = true; //lets start the race
+  raceStarted.set();
 
   //wait for all gloabl threads
   for (auto& th : globalStatsThreads) { th.join(); } 
@@ -318,10 +1662,11 @@ int main ()
   std::cout << "Waited " << elapsed.count() << " ms\n";
   
   //its the time for display data 
-  dumpCollectedStats = true;
+  workersDone.set();
 
   //now wait for collector thread
   collector.join();  
   //std::cout << "completed collector join  \n";
 }
-
+#endif
+#endif /* STATS_NO_MAIN */
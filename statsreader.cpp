@@ -0,0 +1,124 @@
+//compile g++ statsreader.cpp -std=c++11 -O2 -o statsreader
+
+/*
+ * statsreader - out of process reader of a shared memory stats segment (StatsShm.h)
+ *
+ *   statsreader [-i interval_ms] [-n snapshots] <segment>     print the published stats every interval
+ *   statsreader -c [-t seconds] <segment>                     read as fast as possible and check every
+ *                                                             snapshot (checksum, sequence), exit 1 on error
+ */
+#include <iostream>
+#include <thread>
+#include <chrono>
+#include <memory>
+#include <stdlib.h>
+#include <unistd.h>
+#include "StatsShm.h"
+
+/* the writer may not have created the segment yet */
+std::unique_ptr<ShmReader> openSegment(const char* path, uint32_t waitSeconds)
+{
+   auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(waitSeconds);
+   while (true)
+   {
+      try
+      {
+         std::unique_ptr<ShmReader> reader(new ShmReader(path));
+         if (reader->valid()) return reader;
+      }
+      catch (const std::system_error& e)
+      {
+         if (std::chrono::steady_clock::now() > deadline) throw;
+      }
+      if (std::chrono::steady_clock::now() > deadline) return nullptr;
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+   }
+}
+
+int print(ShmReader& reader, uint32_t intervalMs, uint32_t snapshots)
+{
+   ShmReader::Snapshot snapshot;
+   for (uint32_t n = 0; 0 == snapshots || n < snapshots; ++n)
+   {
+      if (!reader.read(snapshot))
+      {
+         std::cerr << "no consistent snapshot" << std::endl;
+         return 1;
+      }
+      std::cout << "sequence: " << snapshot.sequence / 2 << " interval: " << snapshot.intervalNs / 1000000.0
+                << " ms records: " << snapshot.records.size() << " dropped: " << snapshot.dropped << std::endl;
+      for (auto& record : snapshot.records)
+      {
+         std::cout << "id: " << record.statId;
+         if (record.collectionId) std::cout << " collection: " << record.collectionId;
+         std::cout << " value: " << record.value << std::endl;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(intervalMs));
+   }
+   return 0;
+}
+
+int check(ShmReader& reader, uint32_t seconds)
+{
+   ShmReader::Snapshot snapshot;
+   uint64_t reads = 0, retries = 0, failed = 0, corrupt = 0, published = 0, last = 0;
+   auto end = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+   while (std::chrono::steady_clock::now() < end)
+   {
+      if (!reader.read(snapshot))
+      {
+         ++failed;
+         continue;
+      }
+      ++reads;
+      retries += snapshot.retries;
+      if (shmChecksum(snapshot.records.data(), snapshot.records.size()) != snapshot.checksum
+          || snapshot.sequence < last) ++corrupt;
+      if (snapshot.sequence != last) ++published;
+      last = snapshot.sequence;
+   }
+   bool ok = 0 == corrupt && published > 1;
+   std::cout << "reads: " << reads << " intervals seen: " << published << " torn reads retried: " << retries
+             << " gave up: " << failed << " inconsistent: " << corrupt << (ok ? " OK" : " FAILED") << std::endl;
+   return ok ? 0 : 1;
+}
+
+int main(int argc, char** argv)
+{
+   uint32_t intervalMs = 1000, snapshots = 0, seconds = 5;
+   bool checkMode = false;
+   int opt;
+   while ((opt = getopt(argc, argv, "ci:n:t:")) != -1)
+   {
+      switch (opt)
+      {
+         case 'c': checkMode = true; break;
+         case 'i': intervalMs = atoi(optarg); break;
+         case 'n': snapshots = atoi(optarg); break;
+         case 't': seconds = atoi(optarg); break;
+         default:
+            std::cerr << "usage: " << argv[0] << " [-c] [-i interval_ms] [-n snapshots] [-t seconds] <segment>" << std::endl;
+            return 2;
+      }
+   }
+   if (optind >= argc)
+   {
+      std::cerr << "usage: " << argv[0] << " [-c] [-i interval_ms] [-n snapshots] [-t seconds] <segment>" << std::endl;
+      return 2;
+   }
+   try
+   {
+      std::unique_ptr<ShmReader> reader = openSegment(argv[optind], 5);
+      if (!reader)
+      {
+         std::cerr << argv[optind] << ": not a stats segment (version " << SHM_VERSION << ")" << std::endl;
+         return 1;
+      }
+      return checkMode ? check(*reader, seconds) : print(*reader, intervalMs, snapshots);
+   }
+   catch (const std::system_error& e)
+   {
+      std::cerr << e.what() << std::endl;
+      return 1;
+   }
+}